@@ -38,12 +38,17 @@
 #include <linux/uaccess.h>
 #include <linux/usb.h>
 #include <linux/spinlock.h>
-#include <linux/version.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
 
 #include <sound/core.h>
 #include <sound/rawmidi.h>
 #include <sound/initval.h>
 
+#include "dm2compat.h"
 #include "dm2.h"
 
 static int index = SNDRV_DEFAULT_IDX1; /* Index 0-MAX */
@@ -53,29 +58,36 @@ module_param(index, int, 0444);
 MODULE_PARM_DESC(index, "Index value for DM2 MIDI controller.");
 module_param(id, charp, 0444);
 MODULE_PARM_DESC(id, "ID string for DM2 MIDI controller.");
+static int reconnect_grace = 5000; /* ms an unplugged DM2 keeps its card */
+module_param(reconnect_grace, int, 0644);
+MODULE_PARM_DESC(reconnect_grace, "Milliseconds a replugged DM2 may take to reclaim its ALSA card (0 disables).");
+static bool autosuspend = 1;
+module_param(autosuspend, bool, 0444);
+MODULE_PARM_DESC(autosuspend, "Let the DM2 sleep while no MIDI substream is open.");
+static bool pickup_echo = 0;
+module_param(pickup_echo, bool, 0644);
+MODULE_PARM_DESC(pickup_echo, "Treat CCs sent to a slider's parameter as its pickup value.");
+static int slider_filter = DM2_FILTER_NONE;
+module_param(slider_filter, int, 0444);
+MODULE_PARM_DESC(slider_filter, "Slider noise filter: 0 = off, 1 = hysteresis, 2 = adaptive lowpass.");
+static int debounce = 0;
+module_param(debounce, int, 0444);
+MODULE_PARM_DESC(debounce, "Default button debounce window in ms (0 disables).");
+static int poll_interval = 0;
+module_param(poll_interval, int, 0444);
+MODULE_PARM_DESC(poll_interval, "Polling interval in ms (0 uses the device's bInterval).");
+static int wheel_mode = DM2_WHEEL_RELATIVE;
+module_param(wheel_mode, int, 0444);
+MODULE_PARM_DESC(wheel_mode, "Jog output: 0 = relative, 1 = velocity, 2 = 14 bit velocity.");
+static bool local_leds = 0;
+module_param(local_leds, bool, 0644);
+MODULE_PARM_DESC(local_leds, "Light a button's LED at once instead of waiting for the host's echo.");
 
 static struct usb_driver dm2_driver;
 
-// Make kernel version check
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 22)
-#warning This driver will not compile for kernels older than 2.6.22
-#endif
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
-#warning Please make sure your kernel is patched with linux-lowspeedbulk.patch
-#define USE_BULK_SNDPIPE 1
-#endif
-// Kernel API compatibility
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 30)
-static inline int snd_card_create(int idx, const char *id,
-								  struct module *module, int extra_size,
-								  struct snd_card **card_ret)
-{
-	*card_ret = snd_card_new(idx, id, module, extra_size);
-	if (!(*card_ret))
-		return -1;
-	return 0;
-}
-#endif
+/* Unplugged devices whose card is kept alive for a quick replug */
+static LIST_HEAD(dm2_orphans);
+static DEFINE_MUTEX(dm2_orphans_lock);
 
 #define err(format, arg...) printk(KERN_ERR KBUILD_MODNAME ": " format "\n", ##arg)
 #define info(format, arg...) printk(KERN_INFO KBUILD_MODNAME ": " format "\n", ##arg)
@@ -87,6 +99,27 @@ static void dm2_slider_reset(struct dm2slider *slider, u8 value)
 	slider->min = value - slider->dead - 1;
 	slider->max = (slider->max) ? value + slider->dead + 1 : 0;
 	slider->midival = 64;
+	slider->value = 64;
+	slider->pickup[0] = slider->pickup[1] = DM2_NOPICKUP;
+	slider->acc = value << 8;
+}
+
+static void dm2_slider_set_filter(struct dm2slider *slider, u8 mode, u8 amount)
+{
+	switch (mode)
+	{
+	case DM2_FILTER_HYST:
+		slider->amount = amount ? amount : 1;
+		break;
+	case DM2_FILTER_ADAPTIVE:
+		slider->amount = (amount && amount < 8) ? amount : 3;
+		break;
+	default:
+		mode = DM2_FILTER_NONE;
+		slider->amount = 0;
+	}
+	slider->filter = mode;
+	slider->acc = slider->pos << 8;
 }
 
 static void dm2_slider_init(struct dm2slider *slider, u8 param, u8 dead, u8 usemax)
@@ -94,6 +127,7 @@ static void dm2_slider_init(struct dm2slider *slider, u8 param, u8 dead, u8 usem
 	slider->param = param;
 	slider->max = usemax;
 	slider->dead = dead;
+	slider->curvetype = DM2_CURVE_NONE;
 	dm2_slider_reset(slider, slider->mid ? slider->mid : 80); /* Dummy value */
 }
 
@@ -134,23 +168,563 @@ static int dm2_slider_get(struct dm2slider *slider)
 	return value;
 }
 
-static void dm2_slider_update(struct usb_dm2 *dev, struct dm2slider *slider, u8 prev, u8 curr)
+/* Mirror a calibrated position around the center, which stays at 64. */
+static int dm2_slider_mirror(int i)
 {
-	int value;
+	if (i < 64)
+		return 64 + ((64 - i) * 63 + 32) / 64;
+	return 64 - ((i - 64) * 64 + 31) / 63;
+}
+
+/* Precompute a response curve table, only when the curve changes. */
+static void dm2_slider_set_curve(struct dm2slider *slider, u8 type)
+{
+	int i, d, v;
+
+	if (slider->curvetype == type)
+		return;
+	for (i = 0; i < 128; i++)
+	{
+		d = i - 64;
+		switch (type)
+		{
+		case DM2_CURVE_EXP:
+			v = i * i / 127;
+			break;
+		case DM2_CURVE_LOG:
+			v = 127 - (127 - i) * (127 - i) / 127;
+			break;
+		case DM2_CURVE_SCURVE:
+			v = i * i * (3 * 127 - 2 * i) / (127 * 127);
+			break;
+		case DM2_CURVE_CENTER:
+			v = (d < 0) ? 64 - d * d / 64 : 64 + d * d / 63;
+			break;
+		default:
+			type = DM2_CURVE_LINEAR;
+			v = i;
+		}
+		slider->curve[i] = v;
+	}
+	slider->curvetype = type;
+}
+
+/* Noise filter on the raw position. Returns the filtered position. */
+static u8 dm2_slider_filter(struct dm2slider *slider, u8 raw)
+{
+	int diff, filt = slider->acc >> 8;
+
+	switch (slider->filter)
+	{
+	case DM2_FILTER_HYST:
+		if (raw > filt + slider->amount)
+			filt = raw - slider->amount;
+		else if (raw < filt - slider->amount)
+			filt = raw + slider->amount;
+		slider->acc = filt << 8;
+		return filt;
+	case DM2_FILTER_ADAPTIVE:
+		diff = (raw << 8) - slider->acc;
+		// Follow quickly while the fader moves, smooth hard at rest.
+		if (abs(diff) > (DM2_FILTER_MOTION << 8))
+			slider->acc += diff >> 1;
+		else
+			slider->acc += diff >> slider->amount;
+		return (slider->acc + 0x80) >> 8;
+	}
+	slider->acc = raw << 8;
+	return raw;
+}
+
+/* Has the lowpass still some way to go towards the raw position? */
+static int dm2_slider_settling(struct dm2slider *slider, u8 raw)
+{
+	return slider->filter == DM2_FILTER_ADAPTIVE &&
+		   ((slider->acc + 0x80) >> 8) != raw;
+}
+
+/* Calibrated and filtered position, 0-127 with the center at 64. */
+static int dm2_slider_value(struct dm2slider *slider, u8 curr)
+{
+	int value, rawvalue;
 
 	dm2_slider_set(slider, curr);
-	value = dm2_slider_get(slider);
+	value = rawvalue = dm2_slider_get(slider);
+	// The ends stay exact; everything in between goes through the filter.
+	if (slider->filter && rawvalue > 0 && rawvalue < 127)
+	{
+		slider->pos = dm2_slider_filter(slider, curr);
+		value = dm2_slider_get(slider);
+		if (value == slider->value && rawvalue != slider->value)
+			slider->suppressed++;
+	}
+	else
+		slider->acc = curr << 8;
+	slider->value = value;
+	return value;
+}
+
+/* Send a position through the slider's curve, pickup and parameter. */
+static void dm2_slider_send(struct usb_dm2 *dev, struct dm2slider *slider, int value)
+{
+	u8 param = dev->dm2.shifted ? slider->shiftparam : slider->param;
+	u8 pickup = slider->pickup[dev->dm2.shifted];
+
+	value = slider->curve[value];
 	if (value == slider->midival)
 		return;
-	dm2_midi_send(dev, 0xb0, slider->param, value);
+	// Soft takeover: stay quiet until the fader crosses the host's value.
+	if (pickup != DM2_NOPICKUP)
+	{
+		if ((slider->midival < pickup && value < pickup) ||
+			(slider->midival > pickup && value > pickup))
+		{
+			slider->midival = value;
+			return;
+		}
+		// Taken over: for both outputs, if they share the controller.
+		if (slider->param == param)
+			slider->pickup[0] = DM2_NOPICKUP;
+		if (slider->shiftparam == param)
+			slider->pickup[1] = DM2_NOPICKUP;
+	}
+	dm2_midi_send(dev, 0xb0, param, value);
 	slider->midival = value;
 	return;
 }
 
-static void dm2_wheel_update(struct usb_dm2 *dev, struct dm2wheel *wheel, u8 curr)
+static void dm2_slider_update(struct usb_dm2 *dev, struct dm2slider *slider, u8 curr)
+{
+	dm2_slider_send(dev, slider, dm2_slider_value(slider, curr));
+}
+
+/* Joystick geometry. A round dead zone on top of the axes' own small
+ * square one, with the rest of the travel stretched so that the edge
+ * still reaches both ends of each axis: -64 below the center, +63 above.
+ * Only called from the tasklet, which reads the tables. */
+
+static void dm2_stick_set(struct dm2 *dm2, u8 deadzone, u8 flags)
+{
+	struct dm2stick *stick = &(dm2->stick);
+	int r, h, edge;
+
+	stick->deadzone = (deadzone < 63) ? deadzone : 62;
+	stick->flags = flags;
+	for (h = 0; h < 2; h++)
+	{
+		edge = h ? 63 : 64;
+		for (r = 0; r < DM2_STICK_RADIUS; r++)
+		{
+			if (r <= stick->deadzone)
+				stick->scale[h][r] = 0;
+			else
+				stick->scale[h][r] = (r - stick->deadzone) * edge * 256 /
+					((edge - stick->deadzone) * r);
+		}
+	}
+}
+
+/* Scale one axis, centered on 0, for the stick radius r. Rounded, so the
+ * edge maps onto itself. */
+static int dm2_stick_scale(struct dm2stick *stick, int v, int r)
+{
+	v *= stick->scale[v > 0][r];
+	return (v + ((v < 0) ? -128 : 128)) / 256;
+}
+
+static void dm2_stick_update(struct usb_dm2 *dev, u8 currx, u8 curry)
+{
+	struct dm2 *dm2 = &(dev->dm2);
+	struct dm2stick *stick = &(dm2->stick);
+	int x, y, r;
+
+	x = dm2_slider_value(&(dm2->sliders[0]), currx);
+	y = dm2_slider_value(&(dm2->sliders[1]), curry);
+	// Inversion belongs to the physical axis, so it comes before the swap.
+	if (stick->flags & DM2_STICK_INVERTX)
+		x = dm2_slider_mirror(x);
+	if (stick->flags & DM2_STICK_INVERTY)
+		y = dm2_slider_mirror(y);
+	x -= 64;
+	y -= 64;
+	if (stick->deadzone)
+	{
+		r = int_sqrt(x * x + y * y);
+		if (r >= DM2_STICK_RADIUS)
+			r = DM2_STICK_RADIUS - 1;
+		x = dm2_stick_scale(stick, x, r);
+		y = dm2_stick_scale(stick, y, r);
+	}
+	x = clamp(x + 64, 0, 127);
+	y = clamp(y + 64, 0, 127);
+	if (stick->flags & DM2_STICK_SWAP)
+		swap(x, y);
+	dm2_slider_send(dev, &(dm2->sliders[0]), x);
+	dm2_slider_send(dev, &(dm2->sliders[1]), y);
+}
+
+/* Set the pickup value of every slider output sending param, shifted
+ * or not. Returns 0 if no slider uses it. */
+static int dm2_slider_pickup(struct dm2 *dm2, u8 param, u8 value)
+{
+	int i, found = 0;
+
+	for (i = 0; i < 3; i++)
+	{
+		if (dm2->sliders[i].param == param)
+		{
+			dm2->sliders[i].pickup[0] = value;
+			found = 1;
+		}
+		// Without a shift button, shiftparam is unused.
+		if (dm2->shiftbutton != DM2_UNUSED && dm2->sliders[i].shiftparam == param)
+		{
+			dm2->sliders[i].pickup[1] = value;
+			found = 1;
+		}
+	}
+	return found;
+}
+
+static void dm2_wheel_init(struct dm2wheel *wheel, const struct dm2_wheel_params *params,
+						   u8 paramthresh, u8 cursorthresh)
+{
+	int i;
+
+	wheel->turnacc = 0;
+	wheel->pressed = wheel->light = wheel->whenreleased = 0;
+	wheel->midpressed = 0;
+	wheel->jogparam = params->jogparam;
+	wheel->jogfine = params->jogfine;
+	wheel->jogmidival = 64;
+	for (i = 0; i < 8; i++)
+	{
+		wheel->notes[i] = params->notes[i];
+		wheel->params[i] = params->params[i];
+		wheel->midivals[i] = 64;
+	}
+	wheel->relparams = ((params->relparams << 1) & 0xf0) | (params->relparams & 0x07);
+	wheel->notoggle = ((params->notoggle << 1) & 0xf0) | (params->notoggle & 0x07);
+	wheel->wheelused = 0;
+	wheel->midup = params->midup;
+	wheel->middown = params->middown;
+	wheel->midrel = params->midrel;
+	wheel->exclusive = params->excl;
+	wheel->paramthresh = paramthresh;
+	wheel->cursorthresh = cursorthresh;
+}
+
+/* Layer engine: the keys around a wheel switch it between jog, parameter
+ * and cursor modes (see the table in dm2.h). */
+
+static void dm2_wheel_keys(struct usb_dm2 *dev, struct dm2wheel *wheel, u8 curr, u8 currmid)
+{
+	u8 presses, releases, newlight, reset, mask, flagson, flagsoff;
+	int i;
+
+	currmid &= DM2_MIDMASK;
+	if ((wheel->pressed == curr) && (wheel->midpressed == currmid))
+		return;
+	wheel->turnacc = 0;
+
+	// Calculate note on/off
+	presses = ~wheel->pressed & curr;
+	releases = wheel->pressed & ~curr;
+
+	flagson = presses & (wheel->notoggle | ~wheel->light);
+	flagsoff = releases & (wheel->notoggle | ~wheel->whenreleased);
+	for (i = 0, mask = 1; i < 8; i++, mask <<= 1)
+	{
+		if (!wheel->notes[i])
+			continue;
+		if (!wheel->params[i])
+		{
+			if (mask & flagson)
+				dm2_midi_send(dev, 0x90, wheel->notes[i], 0x7f);
+			if (mask & flagsoff)
+				dm2_midi_send(dev, 0x90, wheel->notes[i], 0x00);
+			continue;
+		}
+		if ((wheel->wheelused && (mask & releases & ~wheel->notoggle & ~wheel->whenreleased)) ||
+			((!wheel->wheelused) && (mask & releases & wheel->notoggle)))
+			dm2_midi_send(dev, 0x90, wheel->notes[i], 0x7f);
+	}
+
+	// Mid key
+	if ((wheel->midpressed & ~currmid) && wheel->midrel && wheel->wheelused)
+	{
+		dm2_midi_send(dev, 0x90, wheel->midrel, 0x7f);
+	}
+
+	// Releases
+	releases &= ~DM2_CLR;
+	newlight = wheel->whenreleased & releases;
+	if (!(wheel->exclusive && newlight))
+		newlight |= wheel->light & ~releases;
+	newlight = (newlight & ~DM2_CLR) | DM2_MID(currmid);
+	wheel->whenreleased &= ~releases;
+
+	// Keys which are masked out as toggles
+	newlight = ((newlight & ~wheel->notoggle) |
+				(curr & wheel->notoggle));
+
+	// Bottom keypress: reset values
+	reset = (presses & DM2_CLR);
+	if (flagson || (currmid & ~wheel->midpressed))
+		wheel->wheelused = 0;
+	if ((wheel->pressed ^ curr) & DM2_CLR)
+		wheel->wheelused = 1;
+
+	// Other presses
+	presses = (presses & ~DM2_CLR) | DM2_MID(~wheel->midpressed & currmid);
+	wheel->whenreleased = ((wheel->whenreleased & ~presses) |
+						   (~newlight & presses));
+	newlight |= presses;
+	wheel->light = newlight;
+	wheel->pressed = curr;
+	wheel->midpressed = currmid;
+
+	// Reset values
+	if (!reset)
+		return;
+	for (i = 0, mask = 1; i < 8; i++, mask <<= 1)
+	{
+		if (!(mask & newlight))
+			continue;
+		if (!(wheel->params[i]))
+			continue;
+		if (wheel->midivals[i] == 64)
+			continue;
+		wheel->midivals[i] = 64;
+		dm2_midi_send(dev, 0xb0, wheel->params[i], wheel->midivals[i]);
+	}
+}
+
+/* Send a relative value, split into several CCs if it is too large. */
+static void dm2_wheel_relative(struct usb_dm2 *dev, u8 param, u8 *midival, int diff)
+{
+	int trnc;
+
+	if (!diff)
+	{
+		if (*midival != 64)
+			dm2_midi_send(dev, 0xb0, param, 64);
+		*midival = 64;
+		return;
+	}
+	do
+	{
+		trnc = (diff < -64) ? -64 : (diff > 63) ? 63 : diff;
+		dm2_midi_send(dev, 0xb0, param, trnc + 64);
+		*midival = trnc + 64;
+		diff -= trnc;
+	} while (diff);
+}
+
+static void dm2_wheel_turn(struct usb_dm2 *dev, struct dm2wheel *wheel, u8 step)
+{
+	int acc, midiadd, value, i, diff, thresh;
+	u8 params, mask;
+
+	diff = -(s8)step;
+
+	// Jog wheel mode
+	if (!(wheel->pressed || wheel->light || wheel->midpressed))
+	{
+		dm2_wheel_relative(dev, wheel->jogparam, &wheel->jogmidival, diff);
+		return;
+	}
+
+	// Adjust stepping accumulator (for absolute CCs and cursor motion)
+	thresh = wheel->paramthresh;
+	if (wheel->midpressed && (wheel->midup || wheel->middown))
+		thresh = wheel->cursorthresh;
+	acc = wheel->turnacc;
+	acc += diff;
+	midiadd = acc / thresh;
+	wheel->turnacc = acc % thresh;
+
+	wheel->wheelused = 1;
+
+	// Mid key pressed: only mid parameter / cursor
+	if (wheel->midpressed)
+	{
+		if (wheel->midup || wheel->middown)
+		{
+			if ((midiadd < 0) && wheel->middown)
+			{
+				for (i = 0; i < -midiadd; i++)
+					dm2_midi_send(dev, 0x90, wheel->middown, 0x7f);
+			}
+			if ((midiadd > 0) && wheel->midup)
+			{
+				for (i = 0; i < midiadd; i++)
+					dm2_midi_send(dev, 0x90, wheel->midup, 0x7f);
+			}
+			return;
+		}
+		if (wheel->params[DM2_MIDINDEX])
+		{
+			value = wheel->midivals[DM2_MIDINDEX] + midiadd;
+			value = (value < 0) ? 0 : (value > 127) ? 127 : value;
+			if (value != wheel->midivals[DM2_MIDINDEX])
+			{
+				dm2_midi_send(dev, 0xb0, wheel->params[DM2_MIDINDEX], value);
+				wheel->midivals[DM2_MIDINDEX] = value;
+			}
+			return;
+		}
+	}
+
+	// Use presses, then lights
+	params = wheel->pressed;
+	if (params)
+		wheel->whenreleased = wheel->light & ~params;
+	else
+		params = wheel->light;
+
+	// Transmit params
+	for (i = 0, mask = 1; i < 8; i++, mask <<= 1)
+	{
+		if (!(params & mask))
+			continue;
+		if (!(wheel->params[i]))
+			continue;
+		if (wheel->relparams & mask)
+		{
+			dm2_wheel_relative(dev, wheel->params[i], &wheel->midivals[i], diff);
+			continue;
+		}
+		value = wheel->midivals[i] + midiadd;
+		value = (value < 0) ? 0 : (value > 127) ? 127 : value;
+		if (value != wheel->midivals[i])
+		{
+			dm2_midi_send(dev, 0xb0, wheel->params[i], value);
+			wheel->midivals[i] = value;
+		}
+	}
+}
+
+/* Velocity mode: instead of the turn since the last report, the jog CC
+ * carries the platter speed, measured against the report timestamps and
+ * smoothed over a few reports. It is sent on every report while the
+ * platter moves, and every DM2_WHEEL_TICK ms when no report comes. */
+
+static void dm2_wheel_send_velocity(struct usb_dm2 *dev, struct dm2wheel *wheel)
+{
+	int value;
+
+	// The LSB controller comes from the program, which knows it is free.
+	if (wheel->mode == DM2_WHEEL_VELOCITY14 && wheel->jogfine)
+	{
+		// 1/256 count per ms per step, about 330 at 33 rpm.
+		value = clamp(0x2000 + wheel->velocity, 0, 0x3fff);
+		dm2_midi_send(dev, 0xb0, wheel->jogparam, value >> 7);
+		dm2_midi_send(dev, 0xb0, wheel->jogfine, value & 0x7f);
+		return;
+	}
+	// 1/8 count per ms per step, about 10 at 33 rpm.
+	value = clamp(0x40 + (wheel->velocity >> 5), 0, 0x7f);
+	dm2_midi_send(dev, 0xb0, wheel->jogparam, value);
+}
+
+static void dm2_wheel_stop(struct usb_dm2 *dev, struct dm2wheel *wheel)
+{
+	if (!wheel->touched)
+		return;
+	wheel->touched = 0;
+	wheel->velocity = 0;
+	dm2_wheel_send_velocity(dev, wheel);
+	if (wheel->touchnote != DM2_UNUSED)
+		dm2_midi_send(dev, 0x90, wheel->touchnote, 0x00);
+}
+
+/* Apply the wheel modes queued by the MIDI output. A platter in motion
+ * is stopped first, in its old mode and on its old touch note. */
+static void dm2_wheels_configure(struct usb_dm2 *dev)
+{
+	struct dm2wheel *wheel;
+	u8 config[2][2], pending;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	pending = dev->dm2.next_wheels;
+	dev->dm2.next_wheels = 0;
+	memcpy(config, dev->dm2.next_wheel, sizeof(config));
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	for (i = 0; i < 2; i++)
+	{
+		if (!(pending & (1 << i)))
+			continue;
+		wheel = &(dev->dm2.wheels[i]);
+		dm2_wheel_stop(dev, wheel);
+		wheel->mode = config[i][0];
+		wheel->touchnote = config[i][1] ? config[i][1] : DM2_UNUSED;
+	}
+}
+
+static void dm2_wheel_velocity(struct usb_dm2 *dev, struct dm2wheel *wheel, int step, ktime_t now)
+{
+	s64 delta;
+	int speed;
+
+	if (step)
+	{
+		if (!wheel->touched)
+		{
+			wheel->touched = 1;
+			wheel->velocity = 0;
+			// No previous update: assume one report period.
+			wheel->last = ktime_sub_us(now, dev->stats.period ?
+									   dev->stats.period >> 4 : DM2_WHEEL_TICK * USEC_PER_MSEC);
+			if (wheel->touchnote != DM2_UNUSED)
+				dm2_midi_send(dev, 0x90, wheel->touchnote, 0x7f);
+		}
+		wheel->moved = now;
+	}
+	else if (!wheel->touched)
+		return;
+	else if (ktime_us_delta(now, wheel->moved) > DM2_WHEEL_STOP * USEC_PER_MSEC)
+	{
+		dm2_wheel_stop(dev, wheel);
+		return;
+	}
+
+	delta = clamp_t(s64, ktime_us_delta(now, wheel->last),
+					USEC_PER_MSEC, DM2_WHEEL_STOP * USEC_PER_MSEC);
+	wheel->last = now;
+	speed = step * 256 * (int)USEC_PER_MSEC / (int)delta;
+	wheel->velocity += (speed - wheel->velocity) / 4;
+	dm2_wheel_send_velocity(dev, wheel);
+}
+
+/* In layered programs, the platter only jogs while no wheel key is active. */
+static int dm2_wheel_jogging(struct usb_dm2 *dev, struct dm2wheel *wheel)
+{
+	return !dev->dm2.layered ||
+		!(wheel->pressed || wheel->light || wheel->midpressed);
+}
+
+static void dm2_wheel_update(struct usb_dm2 *dev, struct dm2wheel *wheel, u8 curr, ktime_t now)
 {
 	s8 clamped_curr = curr;
 
+	if (wheel->mode != DM2_WHEEL_RELATIVE && dm2_wheel_jogging(dev, wheel))
+	{
+		// Layered programs count the other way round.
+		dm2_wheel_velocity(dev, wheel, dev->dm2.layered ? -(s8)curr : (s8)curr, now);
+		return;
+	}
+	dm2_wheel_stop(dev, wheel);
+
+	if (dev->dm2.layered)
+	{
+		dm2_wheel_turn(dev, wheel, curr);
+		return;
+	}
+
 	/*if (clamped_curr) {
 		if (wheel->direction == 0) {
 			wheel->direction = (clamped_curr > 0 ? 1 : -1);
@@ -170,7 +744,32 @@ static void dm2_wheel_update(struct usb_dm2 *dev, struct dm2wheel *wheel, u8 cur
 
 	// Note: about 2200 - 2400 units per revolution.
 
-	dm2_midi_send(dev, 0xb0, wheel->number, 0x40 + clamped_curr);
+	dm2_midi_send(dev, 0xb0, wheel->jogparam, 0x40 + clamped_curr);
+}
+
+static void dm2_button_init(struct dm2button *button, u8 mode, u8 velocity, u8 debounce)
+{
+	button->mode = (mode <= DM2_BUTTON_VELOCITY) ? mode : DM2_BUTTON_MOMENTARY;
+	button->velocity = (velocity && velocity < 0x80) ? velocity : 0x7f;
+	button->debounce = debounce;
+	button->toggled = 0;
+}
+
+static void dm2_button_send(struct usb_dm2 *dev, struct dm2button *button, int pressed)
+{
+	switch (button->mode)
+	{
+	case DM2_BUTTON_TOGGLE:
+		if (!pressed)
+			return;
+		button->toggled = !button->toggled;
+		dm2_midi_send(dev, 0x90, button->note, button->toggled ? 0x7f : 0x00);
+		return;
+	case DM2_BUTTON_VELOCITY:
+		dm2_midi_send(dev, 0x90, button->note, pressed ? button->velocity : 0x00);
+		return;
+	}
+	dm2_midi_send(dev, 0x90, button->note, pressed ? 0x7f : 0x00);
 }
 
 static void dm2_leds_update(struct dm2 *dm2, u8 note, u8 vel)
@@ -186,69 +785,337 @@ static void dm2_leds_update(struct dm2 *dm2, u8 note, u8 vel)
 	*((u16 *)(dm2->leds)) = (vel ? leds | (1 << note) : leds & ~(1 << note));
 }
 
+/* Local feedback: the tasklet lights a button's LED right away, instead
+ * of waiting a USB round trip and the host's scheduling for the echo. */
+static void dm2_leds_local(struct usb_dm2 *dev, int bit, int on)
+{
+	struct dm2 *dm2 = &dev->dm2;
+	u8 led = dm2->ledmap[bit];
+	unsigned long flags;
+
+	if (!local_leds || led == DM2_UNUSED)
+		return;
+	spin_lock_irqsave(&dev->lock, flags);
+	dm2_leds_update(dm2, led, on);
+	dm2->ledpending |= 1 << led;
+	dm2->ledlocal++;
+	spin_unlock_irqrestore(&dev->lock, flags);
+}
+
+/* LED change from the host. An echo of what local feedback shows already
+ * leaves the LEDs as they are, so dm2_leds_send() has nothing to write. */
+static void dm2_leds_host(struct usb_dm2 *dev, u8 note, u8 vel)
+{
+	struct dm2 *dm2 = &dev->dm2;
+	unsigned long flags;
+	u16 mask;
+
+	if (note >= 16)
+		return;
+	mask = 1 << note;
+	spin_lock_irqsave(&dev->lock, flags);
+	if (dm2->ledpending & mask)
+	{
+		dm2->ledpending &= ~mask;
+		if (!(*((u16 *)(dm2->leds)) & mask) == !vel)
+			dm2->ledechoes++;
+	}
+	dm2_leds_update(dm2, note, vel);
+	spin_unlock_irqrestore(&dev->lock, flags);
+}
+
+/* Reconfigure the button on report bit i. A note left on by a toggle,
+ * or held into toggle mode, whose release would send nothing, is
+ * released first. */
+static void dm2_button_config(struct usb_dm2 *dev, int i, u8 mode, u8 velocity, u8 debounce)
+{
+	struct dm2 *dm2 = &(dev->dm2);
+	struct dm2button *button = &(dm2->buttons[i]);
+	int held = !!(dm2->buttonstate & dm2->buttonmask & (1U << i));
+
+	if (i != dm2->shiftbutton && button->note != DM2_UNUSED &&
+		(button->toggled || (held && mode == DM2_BUTTON_TOGGLE &&
+							 button->mode != DM2_BUTTON_TOGGLE)))
+	{
+		dm2_midi_send(dev, 0x90, button->note, 0x00);
+		dm2_leds_local(dev, i, 0);
+	}
+	dm2_button_init(button, mode, velocity, debounce);
+}
+
+/* Apply the button configurations queued by the MIDI output. */
+static void dm2_buttons_configure(struct usb_dm2 *dev)
+{
+	u8 config[32][3];
+	unsigned long flags, pending;
+	int i;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	pending = dev->dm2.next_buttons;
+	dev->dm2.next_buttons = 0;
+	memcpy(config, dev->dm2.next_button, sizeof(config));
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	while (pending)
+	{
+		i = __ffs(pending);
+		pending &= ~(1UL << i);
+		dm2_button_config(dev, i, config[i][0], config[i][1], config[i][2]);
+	}
+}
+
+/* Only the bits that differ from the debounced state are visited. A
+ * change within a button's debounce window after its last accepted
+ * change is a bounce: it stays pending and is dropped unless it
+ * persists past the window. */
+
+static void dm2_buttons_update(struct usb_dm2 *dev, u32 curr, ktime_t now)
+{
+	struct dm2 *dm2 = &(dev->dm2);
+	struct dm2button *button;
+	unsigned long diff = (curr ^ dm2->buttonstate) & dm2->buttonmask;
+	u32 mask;
+	int i;
+
+	while (diff)
+	{
+		i = __ffs(diff);
+		mask = 1U << i;
+		diff &= ~mask;
+
+		button = &(dm2->buttons[i]);
+		if (button->debounce &&
+			ktime_us_delta(now, button->changed) < button->debounce * USEC_PER_MSEC)
+			continue;
+		button->changed = now;
+		dm2->buttonstate ^= mask;
+
+		if (i == dm2->shiftbutton)
+			dm2->shifted = !!(curr & mask);
+		else if (button->note != DM2_UNUSED)
+		{
+			dm2_button_send(dev, button, !!(curr & mask));
+			// The LED shows the note's state, as the host would.
+			dm2_leds_local(dev, i, (button->mode == DM2_BUTTON_TOGGLE) ?
+						   button->toggled : !!(curr & mask));
+		}
+	}
+}
+
 static void dm2_leds_send(struct usb_dm2 *dev)
 {
 	struct dm2 *dm2 = &dev->dm2;
-	if (memcmp(dm2->leds, dm2->prev_leds, sizeof(dm2->leds)))
+	unsigned long flags;
+	u8 leds[2];
+
+	spin_lock_irqsave(&dev->lock, flags);
+	memcpy(leds, dm2->leds, sizeof(leds));
+	spin_unlock_irqrestore(&dev->lock, flags);
+	// Layered programs may show the locked wheel keys on the rings.
+	if (dm2->layered && dm2->wheellights)
 	{
-		dm2_set_leds(dev, dm2->leds[1], dm2->leds[0]);
-		memcpy(dm2->prev_leds, dm2->leds, sizeof(dm2->leds));
+		leds[0] |= dm2->wheels[1].light;
+		leds[1] |= dm2->wheels[0].light;
+	}
+	if (memcmp(leds, dm2->prev_leds, sizeof(leds)))
+	{
+		dm2_set_leds(dev, leds[1], leds[0]);
+		memcpy(dm2->prev_leds, leds, sizeof(leds));
+		dm2->ledwrites++;
 	}
 }
 
+/* Switch to another program. Calibration is kept. */
+
+static void dm2_program_load(struct dm2 *dm2, u8 program)
+{
+	const struct dm2_params *params = &(dm2_params[program]);
+	int i;
+
+	dm2->program = program;
+	dm2->layered = params->layered;
+	dm2->wheellights = params->wheellights;
+	for (i = 0; i < 3; i++)
+	{
+		// A pickup belongs to the controller, not to the slider.
+		if (dm2->sliders[i].param != params->sliderparam[i])
+			dm2->sliders[i].pickup[0] = DM2_NOPICKUP;
+		if (dm2->sliders[i].shiftparam != params->shiftparam[i])
+			dm2->sliders[i].pickup[1] = DM2_NOPICKUP;
+		dm2->sliders[i].param = params->sliderparam[i];
+		dm2->sliders[i].shiftparam = params->shiftparam[i];
+		dm2_slider_set_curve(&(dm2->sliders[i]), params->slidercurve[i]);
+	}
+	dm2->shiftbutton = params->shiftbutton;
+	dm2->shifted = 0;
+	for (i = 0; i < 2; i++)
+		dm2_wheel_init(&(dm2->wheels[i]), &(params->wheels[i]),
+					   params->paramthresh, params->cursorthresh);
+	for (i = 0; i < 32; i++)
+	{
+		// A toggled note that stays the same stays on at the host.
+		if (dm2->buttons[i].note != params->buttons[i])
+			dm2->buttons[i].toggled = 0;
+		dm2->buttons[i].note = params->buttons[i];
+	}
+	// Wheel keys and the mid key go to the layer engine instead.
+	dm2->buttonmask = params->layered ? 0xfdff0000 : 0xffffffff;
+}
+
+/* Program change from the tasklet: the buttons held now were pressed
+ * under the old program, so their notes are released first, and the
+ * wheels start from the keys held now. */
+
+static void dm2_program_switch(struct usb_dm2 *dev, u8 program)
+{
+	struct dm2 *dm2 = &(dev->dm2);
+	struct dm2button *button;
+	u32 held = dm2->buttonstate & dm2->buttonmask;
+	int i;
+
+	for (i = 0; i < 2; i++)
+		dm2_wheel_stop(dev, &(dm2->wheels[i]));
+	for (i = 0; i < 32; i++)
+	{
+		button = &(dm2->buttons[i]);
+		if (i == dm2->shiftbutton || button->note == DM2_UNUSED ||
+			button->note == dm2_params[program].buttons[i])
+			continue;
+		if ((button->mode == DM2_BUTTON_TOGGLE) ? button->toggled : (held & (1U << i)))
+		{
+			dm2_midi_send(dev, 0x90, button->note, 0x00);
+			dm2_leds_local(dev, i, 0);
+		}
+	}
+
+	dm2_program_load(dm2, program);
+	// The new program starts from the buttons held now.
+	dm2->buttonstate = get_unaligned_le32(dm2->prev_state);
+
+	if (dm2->layered)
+	{
+		dm2->wheels[0].pressed = dm2->prev_state[1];
+		dm2->wheels[1].pressed = dm2->prev_state[0];
+		dm2->wheels[0].midpressed = dm2->wheels[1].midpressed =
+			dm2->prev_state[3] & DM2_MIDMASK;
+	}
+	if (dm2->shiftbutton != DM2_UNUSED)
+		dm2->shifted = !!(dm2->buttonstate & (1U << dm2->shiftbutton));
+}
+
+/* Keeps the tasklet running while no reports come in, so that moving
+ * platters in velocity mode slow down and stop. */
+
+static void dm2_wheel_timer(struct timer_list *t)
+{
+	struct usb_dm2 *dev = timer_container_of(dev, t, wheel_timer);
+
+	dm2_bh_schedule(&dev->dm2midi.tasklet);
+}
+
 /* Main event handler */
 
-static void dm2_tasklet(unsigned long arg)
+static void dm2_tasklet(DM2_BH_ARG arg)
 {
 	struct usb_dm2 *dev;
-	u8 curr[10], prev[10], i;
+	u8 curr[10], prev[10], curve[3], filter[3][2], i;
+	int settling[3], program, stick, touched;
 	unsigned long flags;
-	u32 button_diff;
+	u32 buttons, seq;
+	ktime_t now;
 
-	dev = (struct usb_dm2 *)arg;
+	dev = dm2_bh_container(arg, struct usb_dm2, dm2midi.tasklet);
 
 	spin_lock_irqsave(&dev->lock, flags);
 	memcpy(curr, dev->dm2.curr_state, 10 * sizeof(u8));
+	now = dev->dm2.curr_time;
+	seq = dev->dm2.curr_seq;
+	program = dev->dm2.next_program;
+	dev->dm2.next_program = -1;
+	stick = dev->dm2.next_stick;
+	dev->dm2.next_stick = -1;
+	memcpy(curve, dev->dm2.next_curve, sizeof(curve));
+	memset(dev->dm2.next_curve, DM2_CURVE_NONE, sizeof(curve));
+	memcpy(filter, dev->dm2.next_filter, sizeof(filter));
+	for (i = 0; i < 3; i++)
+		dev->dm2.next_filter[i][0] = DM2_UNUSED;
 	spin_unlock_irqrestore(&dev->lock, flags);
 
-	// Update LEDs
-	dm2_leds_send(dev);
+	// Without a new report, the wheels have not turned since.
+	if (seq == dev->dm2.seq)
+	{
+		curr[8] = curr[9] = 0;
+		now = ktime_get();
+	}
+	dev->dm2.seq = seq;
+
+	// Program changes take effect between two reports.
+	if (program >= 0)
+		dm2_program_switch(dev, program);
+	// So do the SysEx settings, after the program they override.
+	if (stick >= 0)
+		dm2_stick_set(&dev->dm2, stick >> 8, stick & 0xff);
+	for (i = 0; i < 3; i++)
+	{
+		if (curve[i] != DM2_CURVE_NONE)
+			dm2_slider_set_curve(&(dev->dm2.sliders[i]), curve[i]);
+		if (filter[i][0] != DM2_UNUSED)
+			dm2_slider_set_filter(&(dev->dm2.sliders[i]), filter[i][0], filter[i][1]);
+	}
+	dm2_buttons_configure(dev);
+	dm2_wheels_configure(dev);
 
-	if (!memcmp(dev->dm2.prev_state, curr, sizeof(curr)))
+	// Identical reports only matter while a slider filter settles
+	// or a bouncing button waits for its window to pass.
+	for (i = 0; i < 3; i++)
+		settling[i] = dm2_slider_settling(&(dev->dm2.sliders[i]), curr[i + 5]);
+	buttons = get_unaligned_le32(curr);
+	touched = dev->dm2.wheels[0].touched || dev->dm2.wheels[1].touched;
+
+	if (!memcmp(dev->dm2.prev_state, curr, sizeof(curr)) &&
+		!(settling[0] || settling[1] || settling[2]) &&
+		!((buttons ^ dev->dm2.buttonstate) & dev->dm2.buttonmask) && !touched)
 	{
+		// The host may still have changed the LEDs.
+		dm2_leds_send(dev);
 		return;
 	}
 
 	memcpy(prev, dev->dm2.prev_state, 10 * sizeof(u8));
 
-	// Bytes 0-3: Handle buttons
-	button_diff = *(u32 *)prev ^ *(u32 *)curr;
-	if (button_diff)
+	// Bytes 0, 1: keys around the right and left wheel in layered programs.
+	if (dev->dm2.layered)
 	{
-		for (i = 0; i < 32; ++i)
-		{
-			if (button_diff & (1 << (i)))
-			{
-				dm2_midi_send(dev, 0x90, i, *(u32 *)curr & (1 << (i)) ? 0x7f : 0x00);
-			}
-		}
+		if ((curr[1] != prev[1]) || (curr[3] != prev[3]))
+			dm2_wheel_keys(dev, &(dev->dm2.wheels[0]), curr[1], curr[3]);
+		if ((curr[0] != prev[0]) || (curr[3] != prev[3]))
+			dm2_wheel_keys(dev, &(dev->dm2.wheels[1]), curr[0], curr[3]);
 	}
 
-	// bytes 5, 6, 7: handle sliders.
-	if (curr[5] != prev[5])
-		dm2_slider_update(dev, &(dev->dm2.sliders[0]), prev[5], curr[5]);
-	if (curr[6] != prev[6])
-		dm2_slider_update(dev, &(dev->dm2.sliders[1]), prev[6], curr[6]);
-	if (curr[7] != prev[7])
-		dm2_slider_update(dev, &(dev->dm2.sliders[2]), prev[7], curr[7]);
+	// Bytes 0-3: Handle buttons
+	dm2_buttons_update(dev, buttons, now);
+
+	// bytes 5, 6: joystick, both axes at once; byte 7: fader.
+	if (curr[5] != prev[5] || curr[6] != prev[6] || settling[0] || settling[1])
+		dm2_stick_update(dev, curr[5], curr[6]);
+	if (curr[7] != prev[7] || settling[2])
+		dm2_slider_update(dev, &(dev->dm2.sliders[2]), curr[7]);
 
 	// bytes 8, 9: handle wheels.
-	if (curr[8] || prev[8])
-		dm2_wheel_update(dev, &(dev->dm2.wheels[0]), curr[8]);
-	if (curr[9] || prev[9])
-		dm2_wheel_update(dev, &(dev->dm2.wheels[1]), curr[9]);
+	if (curr[8] || prev[8] || dev->dm2.wheels[0].touched)
+		dm2_wheel_update(dev, &(dev->dm2.wheels[0]), curr[8], now);
+	if (curr[9] || prev[9] || dev->dm2.wheels[1].touched)
+		dm2_wheel_update(dev, &(dev->dm2.wheels[1]), curr[9], now);
+
+	// Update LEDs
+	dm2_leds_send(dev);
 
 	memcpy(dev->dm2.prev_state, curr, 10 * sizeof(u8));
+
+	// Come back if the reports stop while a platter moves.
+	if ((dev->dm2.wheels[0].touched || dev->dm2.wheels[1].touched) &&
+		dev->interface && !dev->suspended)
+		mod_timer(&dev->wheel_timer, jiffies + msecs_to_jiffies(DM2_WHEEL_TICK));
 }
 
 /* URB writing interface */
@@ -264,81 +1131,299 @@ static void dm2_set_leds(struct usb_dm2 *dev, u8 left, u8 right)
 
 /* Basic interpretation of received URBs */
 
+static void dm2_stats_update(struct dm2stats *stats, ktime_t now)
+{
+	s64 delta = ktime_us_delta(now, stats->last);
+	u32 dev;
+
+	stats->reports++;
+	stats->last = now;
+	// Skip the first report and those after a pause.
+	if (delta <= 0 || delta > USEC_PER_SEC)
+		return;
+	if (!stats->period)
+	{
+		stats->period = delta << 4;
+		return;
+	}
+	dev = abs(delta - (stats->period >> 4));
+	stats->period = stats->period - (stats->period >> 4) + delta;
+	stats->jitter = stats->jitter - (stats->jitter >> 4) + dev;
+}
+
 static void dm2_update_status(struct usb_dm2 *dev, u8 *buf, int length)
 {
 	// ATTENTION: Called in interrupt context!
 	int i;
 	unsigned long flags;
+	ktime_t now = ktime_get();
+
+	if (length != 10)
+	{
+		err("Unexpected URB length!");
+		return;
+	}
+
+	dm2_stats_update(&dev->stats, now);
+
+	// Slider initialization with fancy LED blinking.
+	if (dev->dm2.initialize == 38)
+		dm2_set_leds(dev, 0xaa, 0x55);
+	if (dev->dm2.initialize == 25)
+		dm2_set_leds(dev, 0x55, 0xaa);
+	if (dev->dm2.initialize == 12)
+		dm2_set_leds(dev, 0xff, 0xff);
+	if (dev->dm2.initialize == 1)
+		dm2_set_leds(dev, 0x00, 0x00);
+	if (dev->dm2.initialize && (!--dev->dm2.initialize))
+	{
+		for (i = 0; i < 3; i++)
+			dm2_slider_reset(&(dev->dm2.sliders[i]), buf[i + 5]);
+		dm2_set_leds(dev, 0, 0);
+	}
+
+	// Nothing works until initialization is complete!
+	if (dev->dm2.initialize)
+		return;
+
+	// Transfer latest transmission into dm2 structure.
+	spin_lock_irqsave(&dev->lock, flags);
+	memcpy(dev->dm2.curr_state, buf, 10 * sizeof(u8));
+	dev->dm2.curr_time = now;
+	dev->dm2.curr_seq++;
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	// Trigger further processing.
+	dm2_bh_schedule(&dev->dm2midi.tasklet);
+
+	return;
+}
+
+/* Initialize DM2 structure */
+
+static void dm2_internal_init(struct dm2 *dm2)
+{
+	int i;
+
+	memset(dm2, 0, sizeof(&dm2));
+	dm2->initialize = 50;
+	dm2->next_program = -1;
+	dm2->next_stick = -1;
+	memset(dm2->next_curve, DM2_CURVE_NONE, sizeof(dm2->next_curve));
+	for (i = 0; i < 3; i++)
+		dm2->next_filter[i][0] = DM2_UNUSED;
+	dm2->next_buttons = 0;
+	dm2->next_wheels = 0;
+	for (i = 0; i < 3; i++)
+	{
+		dm2_slider_init(&(dm2->sliders[i]), dm2_params[0].sliderparam[i],
+						DM2_SLIDER_DEAD, (i == 2) ? 0 : 1);
+		dm2_slider_set_filter(&(dm2->sliders[i]), slider_filter, 0);
+	}
+	// The X axis counts the other way round.
+	dm2_stick_set(dm2, 0, DM2_STICK_INVERTX);
+	for (i = 0; i < 32; i++)
+	{
+		dm2_button_init(&(dm2->buttons[i]), DM2_BUTTON_MOMENTARY, 0x7f,
+						clamp(debounce, 0, 255));
+		dm2->ledmap[i] = (i < 16) ? i : DM2_UNUSED;
+	}
+	for (i = 0; i < 2; i++)
+	{
+		dm2->wheels[i].mode = (wheel_mode <= DM2_WHEEL_VELOCITY14) ?
+			wheel_mode : DM2_WHEEL_RELATIVE;
+		dm2->wheels[i].touchnote = 0x7e + i;
+	}
+	dm2_program_load(dm2, 0);
+
+	return;
+}
+
+/* Carry the DM2 structure over to a replugged device. Calibration and
+ * mappings are kept; the fresh hardware only needs its LEDs again. */
+
+static void dm2_internal_restore(struct dm2 *dm2)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		dm2->prev_leds[i] = ~dm2->leds[i];
+}
+
+/* MIDI processing */
+
+static void dm2_sysex_process(struct usb_dm2 *dev, u8 *msg, int len)
+{
+	unsigned long flags;
+	int i;
+
+	if (len < 2 || msg[0] != DM2_SYSEX_ID)
+		return;
+
+	switch (msg[1])
+	{
+	case DM2_SYSEX_PICKUP:
+		if (len == 4)
+			dm2_slider_pickup(&dev->dm2, msg[2], msg[3]);
+		return;
+	case DM2_SYSEX_FILTER:
+		if (len != 5 || msg[2] > 2)
+			return;
+		// The filter state belongs to the tasklet, which runs it.
+		spin_lock_irqsave(&dev->lock, flags);
+		dev->dm2.next_filter[msg[2]][0] = msg[3];
+		dev->dm2.next_filter[msg[2]][1] = msg[4];
+		spin_unlock_irqrestore(&dev->lock, flags);
+		dm2_bh_schedule(&dev->dm2midi.tasklet);
+		return;
+	case DM2_SYSEX_BUTTON:
+		if (len != 6)
+			return;
+		// Releasing a toggled note sends MIDI, which only the tasklet may.
+		spin_lock_irqsave(&dev->lock, flags);
+		for (i = 0; i < 32; i++)
+		{
+			if (msg[2] != i && msg[2] != DM2_ALLBUTTONS)
+				continue;
+			memcpy(dev->dm2.next_button[i], &msg[3], 3);
+			dev->dm2.next_buttons |= 1U << i;
+		}
+		spin_unlock_irqrestore(&dev->lock, flags);
+		dm2_bh_schedule(&dev->dm2midi.tasklet);
+		return;
+	case DM2_SYSEX_WHEEL:
+		if (len != 5 || msg[2] > 1 || msg[3] > DM2_WHEEL_VELOCITY14)
+			return;
+		// Stopping a moving platter sends MIDI, which only the tasklet may.
+		spin_lock_irqsave(&dev->lock, flags);
+		memcpy(dev->dm2.next_wheel[msg[2]], &msg[3], 2);
+		dev->dm2.next_wheels |= 1 << msg[2];
+		spin_unlock_irqrestore(&dev->lock, flags);
+		dm2_bh_schedule(&dev->dm2midi.tasklet);
+		return;
+	case DM2_SYSEX_STICK:
+		if (len != 4)
+			return;
+		// The tables are rebuilt by the tasklet, which reads them.
+		spin_lock_irqsave(&dev->lock, flags);
+		dev->dm2.next_stick = (msg[2] << 8) | msg[3];
+		spin_unlock_irqrestore(&dev->lock, flags);
+		dm2_bh_schedule(&dev->dm2midi.tasklet);
+		return;
+	case DM2_SYSEX_CURVE:
+		if (len != 4 || msg[2] > 2)
+			return;
+		// Until the next program change.
+		spin_lock_irqsave(&dev->lock, flags);
+		dev->dm2.next_curve[msg[2]] = msg[3];
+		spin_unlock_irqrestore(&dev->lock, flags);
+		dm2_bh_schedule(&dev->dm2midi.tasklet);
+		return;
+	case DM2_SYSEX_LED:
+		if (len == 4 && msg[2] < 32)
+			dev->dm2.ledmap[msg[2]] = (msg[3] < 16) ? msg[3] : DM2_UNUSED;
+		return;
+	}
+}
+
+static void dm2_midi_message(struct usb_dm2 *dev, u8 cmd, u8 arg1, u8 arg2)
+{
+	unsigned long flags;
+
+	switch (cmd)
+	{
+	case 0xb0:
+		if (pickup_echo && dm2_slider_pickup(&dev->dm2, arg1, arg2))
+			return;
+		dm2_leds_host(dev, arg1, arg2);
+		return;
+	case 0xc0:
+		if (arg1 >= DM2_NUMPRESETS)
+			return;
+		// Hand over to the tasklet, which switches between two reports.
+		// Curves sent before it end with the program they were for.
+		spin_lock_irqsave(&dev->lock, flags);
+		dev->dm2.next_program = arg1;
+		memset(dev->dm2.next_curve, DM2_CURVE_NONE, sizeof(dev->dm2.next_curve));
+		spin_unlock_irqrestore(&dev->lock, flags);
+		dm2_bh_schedule(&dev->dm2midi.tasklet);
+		return;
+	}
+}
+
+/* Byte-wise parser for the MIDI stream sent to the DM2 */
+static void dm2_midi_process(struct usb_dm2 *dev, u8 byte)
+{
+	struct dm2midi *dm2midi = &(dev->dm2midi);
+	u8 cmd;
+
+	// Realtime messages may show up anywhere and mean nothing to us.
+	if (byte >= 0xf8)
+		return;
 
-	if (length != 10)
+	if (byte & 0x80)
 	{
-		err("Unexpected URB length!");
+		if (byte == 0xf7 && dm2midi->in_rstatus == 0xf0 &&
+			dm2midi->sysex_len <= DM2_SYSEX_MAX)
+			dm2_sysex_process(dev, dm2midi->sysex, dm2midi->sysex_len);
+		dm2midi->in_rstatus = (byte == 0xf7) ? 0 : byte;
+		dm2midi->in_args = 0;
+		dm2midi->sysex_len = 0;
 		return;
 	}
 
-	// Invert X joystick axis.
-	buf[5] = ~buf[5];
-
-	// Slider initialization with fancy LED blinking.
-	if (dev->dm2.initialize == 38)
-		dm2_set_leds(dev, 0xaa, 0x55);
-	if (dev->dm2.initialize == 25)
-		dm2_set_leds(dev, 0x55, 0xaa);
-	if (dev->dm2.initialize == 12)
-		dm2_set_leds(dev, 0xff, 0xff);
-	if (dev->dm2.initialize == 1)
-		dm2_set_leds(dev, 0x00, 0x00);
-	if (dev->dm2.initialize && (!--dev->dm2.initialize))
+	if (dm2midi->in_rstatus == 0xf0)
 	{
-		for (i = 0; i < 3; i++)
-			dm2_slider_reset(&(dev->dm2.sliders[i]), buf[i + 5]);
-		dm2_set_leds(dev, 0, 0);
+		// Overlong SysEx is counted but dropped when it ends.
+		if (dm2midi->sysex_len < DM2_SYSEX_MAX)
+			dm2midi->sysex[dm2midi->sysex_len] = byte;
+		if (dm2midi->sysex_len <= DM2_SYSEX_MAX)
+			dm2midi->sysex_len++;
+		return;
 	}
 
-	// Nothing works until initialization is complete!
-	if (dev->dm2.initialize)
+	cmd = dm2midi->in_rstatus & 0xf0;
+	if (cmd < 0x80 || cmd == 0xf0)
+		return;
+	if ((dm2midi->in_rstatus & 0x0f) != dm2midi->chan)
 		return;
 
-	// Transfer latest transmission into dm2 structure.
-	spin_lock_irqsave(&dev->lock, flags);
-	memcpy(dev->dm2.curr_state, buf, 10 * sizeof(u8));
-	spin_unlock_irqrestore(&dev->lock, flags);
-
-	// Trigger further processing.
-	tasklet_schedule(&dev->dm2midi.tasklet);
+	// Fill argument in and check for completion
+	if (!dm2midi->in_args++)
+	{
+		dm2midi->in_arg1 = byte;
+		if (cmd != 0xc0 && cmd != 0xd0)
+			return;
+		byte = 0;
+	}
+	dm2midi->in_args = 0;
 
-	return;
+	dm2_midi_message(dev, cmd, dm2midi->in_arg1, byte);
 }
 
-/* Initialize DM2 structure */
+/* Runtime PM: every open substream keeps the DM2 awake. */
 
-static void dm2_internal_init(struct dm2 *dm2)
+static int dm2_pm_get(struct usb_dm2 *dev)
 {
-	int i;
-
-	memset(dm2, 0, sizeof(&dm2));
-	dm2->initialize = 50;
-	for (i = 0; i < 2; i++)
-	{
-		dm2->wheels[i].number = i;
-	}
-	for (i = 0; i < 3; i++)
-	{
-		dm2_slider_init(&(dm2->sliders[i]), i + 2,
-						5, (i == 2) ? 0 : 1);
-	}
+	int retval = 0;
 
-	return;
+	mutex_lock(&dev->pm_lock);
+	if (dev->interface)
+		retval = usb_autopm_get_interface(dev->interface);
+	if (!retval)
+		dev->opened++;
+	mutex_unlock(&dev->pm_lock);
+	return retval;
 }
 
-/* MIDI processing */
-static void dm2_midi_process(struct usb_dm2 *dev, u8 input[3])
+static void dm2_pm_put(struct usb_dm2 *dev)
 {
-	switch (input[0])
-	{
-	case 0xb0:
-		dm2_leds_update(&dev->dm2, input[1], input[2]);
-	}
+	mutex_lock(&dev->pm_lock);
+	dev->opened--;
+	/* After a disconnect, USB core has already dropped our references. */
+	if (dev->interface)
+		usb_autopm_put_interface(dev->interface);
+	mutex_unlock(&dev->pm_lock);
 }
 
 /* Midi functions */
@@ -346,6 +1431,11 @@ static void dm2_midi_process(struct usb_dm2 *dev, u8 input[3])
 static int dm2_midi_input_open(struct snd_rawmidi_substream *substream)
 {
 	struct usb_dm2 *dev = substream->rmidi->private_data;
+	int retval;
+
+	retval = dm2_pm_get(dev);
+	if (retval)
+		return retval;
 	dev->dm2midi.input = substream;
 	/* Reset the current status */
 	dev->dm2midi.out_rstatus = 0;
@@ -358,6 +1448,7 @@ static int dm2_midi_input_close(struct snd_rawmidi_substream *substream)
 {
 	struct usb_dm2 *dev = substream->rmidi->private_data;
 	dev->dm2midi.input = NULL;
+	dm2_pm_put(dev);
 	/* decrement the count on our device */
 	kref_put(&dev->kref, dm2_delete);
 	return 0;
@@ -366,7 +1457,15 @@ static int dm2_midi_input_close(struct snd_rawmidi_substream *substream)
 static int dm2_midi_output_open(struct snd_rawmidi_substream *substream)
 {
 	struct usb_dm2 *dev = substream->rmidi->private_data;
+	int retval;
+
+	retval = dm2_pm_get(dev);
+	if (retval)
+		return retval;
 	dev->dm2midi.output = substream;
+	/* Start parsing from a clean state */
+	dev->dm2midi.in_rstatus = 0;
+	dev->dm2midi.in_args = 0;
 	/* increment our usage count for the device */
 	kref_get(&dev->kref);
 	return 0;
@@ -375,6 +1474,7 @@ static int dm2_midi_output_open(struct snd_rawmidi_substream *substream)
 static int dm2_midi_output_close(struct snd_rawmidi_substream *substream)
 {
 	struct usb_dm2 *dev = substream->rmidi->private_data;
+	dm2_pm_put(dev);
 	/* decrement the count on our device */
 	kref_put(&dev->kref, dm2_delete);
 	return 0;
@@ -393,11 +1493,16 @@ static void dm2_midi_input_trigger(struct snd_rawmidi_substream *substream, int
 static void dm2_midi_output_trigger(struct snd_rawmidi_substream *substream, int up)
 {
 	struct usb_dm2 *dev = substream->rmidi->private_data;
-	u8 input[3];
+	u8 input[16];
+	int i, count;
 
-	while (snd_rawmidi_transmit(substream, input, 3) == 3)
+	if (!up)
+		return;
+
+	while ((count = snd_rawmidi_transmit(substream, input, sizeof(input))) > 0)
 	{
-		dm2_midi_process(dev, input);
+		for (i = 0; i < count; i++)
+			dm2_midi_process(dev, input[i]);
 	}
 }
 
@@ -433,17 +1538,21 @@ static int dm2_midi_init(struct usb_dm2 *dev)
 	struct snd_card *card;
 	int err;
 
-	tasklet_init(&dev->dm2midi.tasklet, dm2_tasklet, (unsigned long)dev);
+	/* A card that may be handed over to a replugged device is moved
+	 * away from the USB device when that vanishes, see dm2_park(). */
+	dev->reclaimable = (reconnect_grace > 0);
 
 	if (snd_card_new(&dev->udev->dev, index, id, THIS_MODULE, 0, &card) < 0)
 	{
-		printk("%s snd_card_create failed\n", __FUNCTION__);
+		printk("%s snd_card_new failed\n", __FUNCTION__);
 		return -ENOMEM;
 	}
 	dev->dm2midi.card = card;
 	if ((err = snd_rawmidi_new(dev->dm2midi.card, "Mixman DM2", 1, 1, 1, &rmidi)) < 0)
 	{
 		printk("%s snd_rawmidi_new failed\n", __FUNCTION__);
+		snd_card_free(dev->dm2midi.card);
+		dev->dm2midi.card = NULL;
 		return err;
 	}
 	strcpy(rmidi->name, "Mixman DM2");
@@ -457,6 +1566,7 @@ static int dm2_midi_init(struct usb_dm2 *dev)
 	{
 		printk("%s snd_card_register failed\n", __FUNCTION__);
 		snd_card_free(dev->dm2midi.card);
+		dev->dm2midi.card = NULL;
 		return err;
 	}
 
@@ -468,15 +1578,133 @@ static int dm2_midi_init(struct usb_dm2 *dev)
 
 static void dm2_midi_destroy(struct usb_dm2 *dev)
 {
+	/* Open substreams keep the card (and our kref) until they close. */
 	if (dev->dm2midi.card)
 	{
-		snd_card_free(dev->dm2midi.card);
+		snd_card_disconnect(dev->dm2midi.card);
+		snd_card_free_when_closed(dev->dm2midi.card);
 		dev->dm2midi.card = NULL;
 	}
 }
 
 /* End of MIDI functions */
 
+/* sysfs attributes on the USB interface */
+
+static ssize_t slider_suppressed_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct usb_dm2 *dev = usb_get_intfdata(to_usb_interface(d));
+
+	if (!dev)
+		return -ENODEV;
+	return sprintf(buf, "%u %u %u\n", dev->dm2.sliders[0].suppressed,
+				   dev->dm2.sliders[1].suppressed, dev->dm2.sliders[2].suppressed);
+}
+static DEVICE_ATTR_RO(slider_suppressed);
+
+/* Local LED changes, host echoes that confirmed them, and LED writes */
+static ssize_t led_stats_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct usb_dm2 *dev = usb_get_intfdata(to_usb_interface(d));
+
+	if (!dev)
+		return -ENODEV;
+	return sprintf(buf, "%u %u %u\n", dev->dm2.ledlocal,
+				   dev->dm2.ledechoes, dev->dm2.ledwrites);
+}
+static DEVICE_ATTR_RO(led_stats);
+
+static ssize_t reports_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct usb_dm2 *dev = usb_get_intfdata(to_usb_interface(d));
+
+	if (!dev)
+		return -ENODEV;
+	return sprintf(buf, "%u\n", dev->stats.reports);
+}
+static DEVICE_ATTR_RO(reports);
+
+/* Reports per second, with two decimals */
+static ssize_t report_rate_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct usb_dm2 *dev = usb_get_intfdata(to_usb_interface(d));
+	u32 period, rate;
+
+	if (!dev)
+		return -ENODEV;
+	period = dev->stats.period;
+	rate = period ? 1600000000U / period : 0;
+	return sprintf(buf, "%u.%02u\n", rate / 100, rate % 100);
+}
+static DEVICE_ATTR_RO(report_rate);
+
+/* Mean deviation of the time between reports, in us */
+static ssize_t report_jitter_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct usb_dm2 *dev = usb_get_intfdata(to_usb_interface(d));
+
+	if (!dev)
+		return -ENODEV;
+	return sprintf(buf, "%u\n", dev->stats.jitter >> 4);
+}
+static DEVICE_ATTR_RO(report_jitter);
+
+static ssize_t poll_interval_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct usb_dm2 *dev = usb_get_intfdata(to_usb_interface(d));
+
+	if (!dev || !dev->int_in_urb)
+		return -ENODEV;
+	return sprintf(buf, "%d\n", dev->int_in_urb->interval);
+}
+
+/* Takes effect at once. 0 goes back to the device's bInterval. */
+static ssize_t poll_interval_store(struct device *d, struct device_attribute *attr,
+								   const char *buf, size_t count)
+{
+	struct usb_interface *interface = to_usb_interface(d);
+	struct usb_dm2 *dev = usb_get_intfdata(interface);
+	unsigned int value;
+	int retval;
+
+	if (!dev)
+		return -ENODEV;
+	retval = kstrtouint(buf, 0, &value);
+	if (retval)
+		return retval;
+	if (value > 255)
+		return -EINVAL;
+
+	// Keep the device awake while its reader is restarted. pm_lock
+	// keeps a second writer off the URB while it is refilled.
+	mutex_lock(&dev->pm_lock);
+	retval = dev->interface ? usb_autopm_get_interface(interface) : -ENODEV;
+	if (!retval)
+	{
+		dev->poll_interval = value;
+		retval = dm2_restart_reader(dev);
+		usb_autopm_put_interface(interface);
+	}
+	mutex_unlock(&dev->pm_lock);
+
+	return retval ? retval : count;
+}
+static DEVICE_ATTR_RW(poll_interval);
+
+static struct attribute *dm2_attrs[] = {
+	&dev_attr_slider_suppressed.attr,
+	&dev_attr_led_stats.attr,
+	&dev_attr_reports.attr,
+	&dev_attr_report_rate.attr,
+	&dev_attr_report_jitter.attr,
+	&dev_attr_poll_interval.attr,
+	NULL,
+};
+
+static const struct attribute_group dm2_attr_group = {
+	.attrs = dm2_attrs,
+};
+
 /* Generic USB driver section below. Only hook new functions in, do not edit a lot! */
 
 static void dm2_write_int_callback(struct urb *urb)
@@ -507,10 +1735,7 @@ static ssize_t dm2_write(struct usb_dm2 *dev, const char *data, size_t count)
 	size_t writesize = min(count, (size_t)MAX_TRANSFER);
 	unsigned long flags;
 
-	/* If there's trouble with output (on <=2.6.22 without patch),
-	 * we bail out immediately. */
-
-	/* This doubles as a collision preventer... */
+	/* Bail out if output failed, or while a write is still in flight. */
 	if (dev->output_failed)
 		goto exit;
 
@@ -525,20 +1750,26 @@ static ssize_t dm2_write(struct usb_dm2 *dev, const char *data, size_t count)
 		goto exit;
 	}
 
-	urb = dev->int_out_urb;
-	buf = dev->int_out_buffer;
-
-	memcpy(buf, data, writesize);
-
 	/* this lock makes sure we don't submit URBs to gone devices */
 	spin_lock_irqsave(&dev->lock, flags);
-	if (!dev->interface)
-	{ /* disconnect() was called */
+	if (!dev->interface || dev->suspended)
+	{ /* disconnect() or suspend() was called */
+		spin_unlock_irqrestore(&dev->lock, flags);
+		retval = dev->interface ? -EBUSY : -ENODEV;
+		goto error;
+	}
+
+	urb = dev->int_out_urb;
+	buf = dev->int_out_buffer;
+	if (!urb)
+	{ /* a replugged device whose writer is not set up yet */
 		spin_unlock_irqrestore(&dev->lock, flags);
 		retval = -ENODEV;
 		goto error;
 	}
 
+	memcpy(buf, data, writesize);
+
 	/* send the data out the int port */
 	retval = usb_submit_urb(urb, GFP_ATOMIC);
 	spin_unlock_irqrestore(&dev->lock, flags);
@@ -551,7 +1782,6 @@ static ssize_t dm2_write(struct usb_dm2 *dev, const char *data, size_t count)
 			dev->output_failed = 1;
 			info("Your kernel cannot transmit data to the DM2.");
 			info("The driver will still work, but there will be no LED output.");
-			info("To make the LEDs work on 2.6.22, please apply the kernel patch that came with this driver!");
 		}
 		goto error;
 	}
@@ -579,7 +1809,8 @@ static void dm2_read_int_callback(struct urb *urb)
 	{
 		dm2_update_status(dev, urb->transfer_buffer, urb->actual_length);
 	}
-	if (urb->status != -ENOENT && urb->status != -ECONNRESET)
+	if (urb->status != -ENOENT && urb->status != -ECONNRESET &&
+		urb->status != -ESHUTDOWN)
 	{
 		urb->dev = dev->udev;
 		usb_submit_urb(urb, GFP_ATOMIC);
@@ -602,16 +1833,9 @@ static int dm2_setup_writer(struct usb_dm2 *dev)
 		kfree(buf);
 		return -ENOMEM;
 	}
-#ifdef USE_BULK_SNDPIPE
-	// Compatibility code for older kernels:
-	usb_fill_bulk_urb(urb, dev->udev,
-					  usb_sndbulkpipe(dev->udev, dev->int_out_endpointAddr),
-					  buf, bufsize, dm2_write_int_callback, dev);
-#else
 	usb_fill_int_urb(urb, dev->udev,
 					 usb_sndintpipe(dev->udev, dev->int_out_endpointAddr),
 					 buf, bufsize, dm2_write_int_callback, dev, 10);
-#endif
 	// urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP || URB_ZERO_PACKET;
 
 	dev->int_out_urb = urb;
@@ -620,6 +1844,36 @@ static int dm2_setup_writer(struct usb_dm2 *dev)
 	return 0;
 }
 
+/* Polling interval in ms, clamped for low-speed devices */
+static int dm2_reader_interval(struct usb_dm2 *dev)
+{
+	int interval = dev->poll_interval ? dev->poll_interval : dev->int_in_interval;
+
+	if (dev->udev->speed == USB_SPEED_LOW && interval < DM2_LOWSPEED_MIN_INTERVAL)
+		interval = DM2_LOWSPEED_MIN_INTERVAL;
+	return clamp(interval, 1, 255);
+}
+
+static void dm2_fill_reader(struct usb_dm2 *dev, struct urb *urb, void *buf, int bufsize)
+{
+	usb_fill_int_urb(urb, dev->udev,
+					 usb_rcvintpipe(dev->udev, dev->int_in_endpointAddr),
+					 buf, bufsize,
+					 dm2_read_int_callback, dev, dm2_reader_interval(dev));
+}
+
+/* Resubmit the reader with the current polling interval */
+static int dm2_restart_reader(struct usb_dm2 *dev)
+{
+	struct urb *urb = dev->int_in_urb;
+
+	usb_kill_urb(urb);
+	dm2_fill_reader(dev, urb, urb->transfer_buffer, urb->transfer_buffer_length);
+	// Measure the new rate from scratch.
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	return usb_submit_urb(urb, GFP_KERNEL);
+}
+
 static int dm2_setup_reader(struct usb_dm2 *dev)
 {
 	int bufsize = 32;
@@ -637,45 +1891,153 @@ static int dm2_setup_reader(struct usb_dm2 *dev)
 		kfree(buf);
 		return -ENOMEM;
 	}
-	usb_fill_int_urb(urb, dev->udev,
-					 usb_rcvintpipe(dev->udev, dev->int_in_endpointAddr),
-					 buf, bufsize,
-					 dm2_read_int_callback, dev, dev->int_in_interval);
+	dm2_fill_reader(dev, urb, buf, bufsize);
 	dev->int_in_urb = urb;
+	dev->int_in_buffer = buf;
 	retval = usb_submit_urb(urb, GFP_KERNEL);
 	if (retval)
-	{
-		kfree(buf);
 		return retval;
-	}
 	return 0;
 }
 
+/* Stop the URBs and the tasklet. May be called more than once. */
+static void dm2_stop_io(struct usb_dm2 *dev)
+{
+	if (dev->int_in_urb)
+		usb_kill_urb(dev->int_in_urb);
+	if (dev->int_out_urb)
+		usb_kill_urb(dev->int_out_urb);
+	/* timer first, so it cannot queue the tasklet after the kill. The
+	 * tasklet no longer rearms the timer once interface or suspended
+	 * tell it so, which the callers did already; a run that started
+	 * before may still have, hence the second round. */
+	timer_delete_sync(&dev->wheel_timer);
+	dm2_bh_kill(&dev->dm2midi.tasklet);
+	timer_delete_sync(&dev->wheel_timer);
+	dm2_bh_kill(&dev->dm2midi.tasklet);
+}
+
+/* Release the URBs, which are bound to one particular usb_device. */
+static void dm2_free_io(struct usb_dm2 *dev)
+{
+	usb_free_urb(dev->int_in_urb);
+	usb_free_urb(dev->int_out_urb);
+	kfree(dev->int_in_buffer);
+	kfree(dev->int_out_buffer);
+	dev->int_in_urb = NULL;
+	dev->int_out_urb = NULL;
+	dev->int_in_buffer = NULL;
+	dev->int_out_buffer = NULL;
+}
+
 static void dm2_delete(struct kref *kref)
 {
 	struct usb_dm2 *dev = to_dm2_dev(kref);
-	// struct urb *urb;
 
+	/* a late program change may still have scheduled it */
+	timer_delete_sync(&dev->wheel_timer);
+	dm2_bh_kill(&dev->dm2midi.tasklet);
+	dm2_free_io(dev);
 	usb_put_dev(dev->udev);
-	kfree(dev->int_in_buffer);
+	kfree(dev);
+}
 
-	/* XXX  Handling correct? */
-	kfree(dev->int_out_buffer);
-	// urb = dev->int_out_urb;
-	// usb_free_urb(urb);
+/* Hot-unplug handling: an unplugged DM2 keeps its ALSA card, state and
+ * calibration for reconnect_grace ms. If the same port comes back within
+ * that time, the new device takes over the old card, so open MIDI
+ * connections survive a cable bump. */
 
-	kfree(dev);
+static void dm2_reap(struct work_struct *work)
+{
+	struct usb_dm2 *dev = container_of(to_delayed_work(work), struct usb_dm2, reap);
+
+	mutex_lock(&dm2_orphans_lock);
+	if (list_empty(&dev->orphan))
+	{ /* reclaimed in the meantime */
+		mutex_unlock(&dm2_orphans_lock);
+		return;
+	}
+	list_del_init(&dev->orphan);
+	mutex_unlock(&dm2_orphans_lock);
+
+	info("Mixman DM2 did not come back, releasing its card.");
+	dm2_midi_destroy(dev);
+	kref_put(&dev->kref, dm2_delete);
+}
+
+/* The card hangs below the USB device while there is one, so udev's
+ * path based names work. An orphan's card waits without a parent. */
+static void dm2_card_move(struct usb_dm2 *dev, struct device *parent)
+{
+	struct snd_card *card = dev->dm2midi.card;
+
+	if (!card)
+		return;
+	if (device_move(&card->card_dev, parent,
+					parent ? DPM_ORDER_PARENT_BEFORE_DEV : DPM_ORDER_NONE))
+		err("Could not move the sound card.");
+	else
+		card->dev = parent;
+}
+
+static void dm2_park(struct usb_dm2 *dev)
+{
+	/* before the USB device is gone */
+	dm2_card_move(dev, NULL);
+	mutex_lock(&dm2_orphans_lock);
+	list_add_tail(&dev->orphan, &dm2_orphans);
+	mutex_unlock(&dm2_orphans_lock);
+	schedule_delayed_work(&dev->reap, msecs_to_jiffies(reconnect_grace));
+}
+
+static struct usb_dm2 *dm2_reclaim(struct usb_device *udev)
+{
+	struct usb_dm2 *dev, *found = NULL;
+
+	mutex_lock(&dm2_orphans_lock);
+	list_for_each_entry(dev, &dm2_orphans, orphan)
+	{
+		if (dev->udev->bus->busnum == udev->bus->busnum &&
+			!strcmp(dev->udev->devpath, udev->devpath))
+		{
+			found = dev;
+			break;
+		}
+	}
+	if (found)
+		list_del_init(&found->orphan);
+	mutex_unlock(&dm2_orphans_lock);
+
+	/* A reap that is already running sees the empty list entry and backs off. */
+	if (found)
+		cancel_delayed_work(&found->reap);
+	return found;
 }
 
 static int dm2_probe(struct usb_interface *interface, const struct usb_device_id *id)
 {
 	struct usb_dm2 *dev;
+	struct usb_device *udev = interface_to_usbdev(interface);
 	struct usb_host_interface *iface_desc;
 	struct usb_endpoint_descriptor *endpoint;
 	size_t buffer_size;
-	int i;
+	unsigned long flags;
+	int i, reclaimed = 0;
 	int retval = -ENOMEM;
 
+	/* a DM2 replugged on the same port takes over its old card */
+	dev = dm2_reclaim(udev);
+	if (dev)
+	{
+		reclaimed = 1;
+		/* keep opens out until their autopm references are restored */
+		mutex_lock(&dev->pm_lock);
+		usb_put_dev(dev->udev);
+		sema_init(&dev->limit_sem, WRITES_IN_FLIGHT);
+		dev->output_failed = 0;
+		goto attach;
+	}
+
 	/* allocate memory for our device state and initialize it */
 	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
 	if (!dev)
@@ -684,11 +2046,18 @@ static int dm2_probe(struct usb_interface *interface, const struct usb_device_id
 		goto error;
 	}
 	kref_init(&dev->kref);
+	/* set up before anything that may fail: dm2_delete() kills them */
+	dm2_bh_init(&dev->dm2midi.tasklet, dm2_tasklet);
+	timer_setup(&dev->wheel_timer, dm2_wheel_timer, 0);
 	sema_init(&dev->limit_sem, WRITES_IN_FLIGHT);
 	spin_lock_init(&dev->lock);
+	mutex_init(&dev->pm_lock);
+	dev->poll_interval = clamp(poll_interval, 0, 255);
+	INIT_LIST_HEAD(&dev->orphan);
+	INIT_DELAYED_WORK(&dev->reap, dm2_reap);
 
-	dev->udev = usb_get_dev(interface_to_usbdev(interface));
-	dev->interface = interface;
+attach:
+	dev->udev = usb_get_dev(udev);
 
 	/* set up the endpoint information */
 	/* use only the first int-in and int-out endpoints */
@@ -704,33 +2073,18 @@ static int dm2_probe(struct usb_interface *interface, const struct usb_device_id
 			dev->int_in_size = buffer_size;
 			dev->int_in_endpointAddr = endpoint->bEndpointAddress;
 			dev->int_in_interval = endpoint->bInterval;
-			dev->int_in_buffer = kmalloc(buffer_size, GFP_KERNEL);
-			if (!dev->int_in_buffer)
-			{
-				err("Could not allocate int_in_buffer");
-				goto error;
-			}
-		}
-#ifdef USE_BULK_SNDPIPE
-		// Compatibility code for older kernels:
-		if (!dev->int_out_endpointAddr &&
-			usb_endpoint_is_bulk_out(endpoint))
-		{
-			/* we found a bulk out endpoint */
-			dev->int_out_endpointAddr = endpoint->bEndpointAddress;
 		}
-#else
 		if (!dev->int_out_endpointAddr &&
 			usb_endpoint_is_int_out(endpoint))
 		{
 			/* we found an int out endpoint */
 			dev->int_out_endpointAddr = endpoint->bEndpointAddress;
 		}
-#endif
 	}
 	if (!(dev->int_in_endpointAddr && dev->int_out_endpointAddr))
 	{
 		err("Could not find both int-in and int-out endpoints");
+		retval = -ENODEV;
 		goto error;
 	}
 
@@ -745,31 +2099,74 @@ static int dm2_probe(struct usb_interface *interface, const struct usb_device_id
 		goto error;
 	}
 
-	retval = dm2_setup_reader(dev);
+	/* a reclaimed card's tasklet may write as soon as this is set */
+	spin_lock_irqsave(&dev->lock, flags);
+	dev->interface = interface;
+	dev->suspended = 0;
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	if (reclaimed)
+	{
+		dm2_card_move(dev, &dev->udev->dev);
+		dm2_internal_restore(&(dev->dm2));
+	}
+	else
+	{
+		retval = dm2_midi_init(dev);
+		if (retval)
+		{
+			err("Problem setting up MIDI.");
+			usb_set_intfdata(interface, NULL);
+			goto error;
+		}
+
+		dm2_internal_init(&(dev->dm2));
+	}
+
+	retval = sysfs_create_group(&interface->dev.kobj, &dm2_attr_group);
 	if (retval)
 	{
-		err("Problem setting up the reader.");
+		err("Problem creating sysfs attributes.");
 		usb_set_intfdata(interface, NULL);
 		goto error;
 	}
 
-	retval = dm2_midi_init(dev);
+	/* The reader goes last: reports may arrive immediately. */
+	retval = dm2_setup_reader(dev);
 	if (retval)
 	{
-		err("Problem setting up MIDI.");
+		err("Problem setting up the reader.");
+		sysfs_remove_group(&interface->dev.kobj, &dm2_attr_group);
 		usb_set_intfdata(interface, NULL);
 		goto error;
 	}
 
-	dm2_internal_init(&(dev->dm2));
+	if (autosuspend)
+		usb_enable_autosuspend(udev);
 
-	info("Mixman DM2 device now attached.");
+	if (reclaimed)
+	{
+		/* substreams still open on the old card keep the new device awake */
+		for (i = 0; i < dev->opened; i++)
+			usb_autopm_get_interface_no_resume(interface);
+		mutex_unlock(&dev->pm_lock);
+		info("Mixman DM2 reattached to its previous card.");
+	}
+	else
+		info("Mixman DM2 device now attached.");
 	return 0;
 
 error:
+	if (reclaimed)
+		mutex_unlock(&dev->pm_lock);
 	if (dev)
+	{
+		dev->interface = NULL;
+		dm2_stop_io(dev);
+		dm2_midi_destroy(dev);
 		/* this frees allocated memory */
 		kref_put(&dev->kref, dm2_delete);
+	}
 	return retval;
 }
 
@@ -780,7 +2177,10 @@ static void dm2_disconnect(struct usb_interface *interface)
 
 	dev = usb_get_intfdata(interface);
 
+	sysfs_remove_group(&interface->dev.kobj, &dm2_attr_group);
+
 	/* prevent dm2_open() from racing dm2_disconnect() */
+	mutex_lock(&dev->pm_lock);
 	spin_lock_irqsave(&dev->lock, flags);
 
 	usb_set_intfdata(interface, NULL);
@@ -788,21 +2188,78 @@ static void dm2_disconnect(struct usb_interface *interface)
 	dev->interface = NULL;
 
 	spin_unlock_irqrestore(&dev->lock, flags);
+	mutex_unlock(&dev->pm_lock);
 
-	/* decrement our usage count */
-	kref_put(&dev->kref, dm2_delete);
+	/* nothing may touch the URBs once they are gone */
+	dm2_stop_io(dev);
+	dm2_free_io(dev);
+
+	if (dev->reclaimable && reconnect_grace > 0)
+	{
+		dm2_park(dev);
+		info("Mixman DM2 unplugged, keeping its card for %d ms.", reconnect_grace);
+		return;
+	}
 
 	dm2_midi_destroy(dev);
 
+	/* decrement our usage count */
+	kref_put(&dev->kref, dm2_delete);
+
 	info("Mixman DM2 now disconnected");
 }
 
+static int dm2_suspend(struct usb_interface *interface, pm_message_t message)
+{
+	struct usb_dm2 *dev = usb_get_intfdata(interface);
+	unsigned long flags;
+
+	if (!dev)
+		return 0;
+
+	/* Calibration needs its 50 reports in a row. */
+	if (dev->dm2.initialize && PMSG_IS_AUTO(message))
+		return -EBUSY;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	dev->suspended = 1;
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	dm2_stop_io(dev);
+	return 0;
+}
+
+/* Also used for reset_resume: all state we need lives in the driver. */
+static int dm2_resume(struct usb_interface *interface)
+{
+	struct usb_dm2 *dev = usb_get_intfdata(interface);
+	unsigned long flags;
+
+	if (!dev)
+		return 0;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	dev->suspended = 0;
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	/* The stored calibration stays valid, so the first report after
+	 * waking is handled right away. Only the LEDs went dark. */
+	dm2_internal_restore(&(dev->dm2));
+	if (!dev->dm2.initialize)
+		dm2_leds_send(dev);
+
+	return usb_submit_urb(dev->int_in_urb, GFP_NOIO);
+}
+
 static struct usb_driver dm2_driver = {
 	.name = "Mixman DM2",
 	.probe = dm2_probe,
 	.disconnect = dm2_disconnect,
+	.suspend = dm2_suspend,
+	.resume = dm2_resume,
+	.reset_resume = dm2_resume,
 	.id_table = dm2_table,
-	.supports_autosuspend = 0,
+	.supports_autosuspend = 1,
 };
 
 static int __init usb_dm2_init(void)
@@ -819,8 +2276,28 @@ static int __init usb_dm2_init(void)
 
 static void __exit usb_dm2_exit(void)
 {
+	struct usb_dm2 *dev;
+
 	/* deregister this driver with the USB subsystem */
 	usb_deregister(&dm2_driver);
+
+	/* release the cards of devices still waiting for a replug */
+	for (;;)
+	{
+		mutex_lock(&dm2_orphans_lock);
+		if (list_empty(&dm2_orphans))
+		{
+			mutex_unlock(&dm2_orphans_lock);
+			break;
+		}
+		dev = list_first_entry(&dm2_orphans, struct usb_dm2, orphan);
+		list_del_init(&dev->orphan);
+		mutex_unlock(&dm2_orphans_lock);
+
+		cancel_delayed_work_sync(&dev->reap);
+		dm2_midi_destroy(dev);
+		kref_put(&dev->kref, dm2_delete);
+	}
 }
 
 module_init(usb_dm2_init);
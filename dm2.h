@@ -14,17 +14,198 @@
  *
  */
 
+/* Structure with the control configuration of one program. */
+/* Programs are selected with a MIDI program change. */
+
+#define DM2_UNUSED 0xff			/* Button sends nothing */
+
+#define DM2_CURVE_LINEAR 0
+#define DM2_CURVE_EXP 1			/* Fine control at the low end */
+#define DM2_CURVE_LOG 2			/* Fine control at the high end */
+#define DM2_CURVE_SCURVE 3		/* Fine control at both ends */
+#define DM2_CURVE_CENTER 4		/* Fine control around the center */
+#define DM2_CURVE_NONE 0xff		/* No table built yet */
+
+struct dm2_wheel_params {
+	u8 jogparam;
+	u8 jogfine;			/* Low 7 bits of a 14 bit jog speed, 0 for none */
+	// Wheel button Notes/Params:  NW   W  SW   S  SE   E  NE   N
+	u8 notes[8];
+	u8 params[8];
+	// Use parameters in relative mode: nn NW  W  SW  SE  E  NE  N
+	u8 relparams;
+	// Disable toggle mode on which keys: nn NW  W  SW  SE  E  NE  N
+	u8 notoggle;
+	// Mid button up/down keys, on-release key
+	u8 midup, middown, midrel;
+	// Exclusive mode? (only one param at a time)
+	u8 excl;
+};
+
+struct dm2_params {
+	u8 layered;			/* Wheel keys drive the modal layer engine */
+	// Slider parameters:  X  Y  Fader
+	u8 sliderparam[3];
+	u8 slidercurve[3];		/* DM2_CURVE_* */
+	// Shift button (report bit) and slider parameters while it is held
+	u8 shiftbutton;
+	u8 shiftparam[3];
+
+	u8 paramthresh;
+	u8 cursorthresh;
+	struct dm2_wheel_params wheels[2];
+	// Note for each report bit. In layered programs, bytes 0 and 1
+	// belong to the wheels and byte 3 bit 1 is the mid key.
+	u8 buttons[32];
+	u8 wheellights;			/* Show locked wheel keys on the LED rings */
+};
+
+/* How to parameterize wheel keys in layered programs:
+ *
+ * allowed combination       meaning
+ * notoggle note  param
+ * off      set   unset      press: note on; release: note off.
+ * off      unset set        press: wheel into param mode, lock. 2nd release: unlock
+ * on       unset set        press: wheel into param mode. release: nothing
+ * off      set   set        press: wheel into param mode, lock. 2nd release: note on if wheel turned, unlock
+ * on       set   set        press: wheel into param mode. release: note on if no wheel turn.
+ */
+
+#define DM2_RAWBUTTONS(b) (b), (b) + 1, (b) + 2, (b) + 3, (b) + 4, (b) + 5, (b) + 6, (b) + 7
+#define DM2_NOBUTTONS DM2_UNUSED, DM2_UNUSED, DM2_UNUSED, DM2_UNUSED, \
+	DM2_UNUSED, DM2_UNUSED, DM2_UNUSED, DM2_UNUSED
+
+#define DM2_NUMPRESETS 4
+static const struct dm2_params dm2_params[DM2_NUMPRESETS] = {
+	{ // Program 0: Raw (every button is a note, wheels are jog CCs)
+		.layered = 0,
+		.sliderparam = {2, 3, 4},
+		.shiftbutton = DM2_UNUSED,
+		.wheels = {
+			{ .jogparam = 0, .jogfine = 32 },
+			{ .jogparam = 1, .jogfine = 33 },
+		},
+		.buttons = { DM2_RAWBUTTONS(0), DM2_RAWBUTTONS(8),
+			     DM2_RAWBUTTONS(16), DM2_RAWBUTTONS(24) },
+	},
+	{ // Program 1: Mixxx (see mixxx/), T2 shifts the Y axis
+		.layered = 1,
+		.sliderparam = {4, 5, 2},
+		.slidercurve = {DM2_CURVE_LINEAR, DM2_CURVE_EXP, DM2_CURVE_LINEAR},
+		.shiftbutton = 20,
+		.shiftparam = {4, 6, 2},
+		.paramthresh = 4,
+		.cursorthresh = 12,
+		.wheels = {
+			{
+				.jogparam = 1, .jogfine = 41,
+				//           NW   W  SW   S  SE   E  NE   N
+				.notes =  { 16, 17, 18,  0, 20, 21, 22,  0 },
+				.params = { 16, 17, 18,  0, 20, 21, 22, 23 },
+				.relparams = 0,
+				.notoggle = 0x3f,
+				.midup = 65, .middown = 66, .midrel = 67,
+				.excl = 1,
+			},
+			{
+				.jogparam = 3, .jogfine = 43,
+				.notes =  { 32, 33, 34,  0, 36, 37, 38,  0 },
+				.params = { 32, 33, 34,  0, 36, 37, 38, 39 },
+				.relparams = 0,
+				.notoggle = 0x3f,
+				.midup = 65, .middown = 66, .midrel = 68,
+				.excl = 1,
+			},
+		},
+		//            Stop Play Rec  T3  T2  T1   R   L
+		.buttons = { DM2_NOBUTTONS, DM2_NOBUTTONS,
+			     48, 49, 50, 51, 52, 53, 54, 55,
+		//             nn Mid   B   A  B4  B3  B2  B1
+			     DM2_UNUSED, DM2_UNUSED, 58, 59, 60, 61, 62, 63 },
+		.wheellights = 1,
+	},
+	{ // Program 2: Simple program (only CC multiplexing with toggle switches)
+		.layered = 1,
+		.sliderparam = {4, 5, 2},
+		.shiftbutton = DM2_UNUSED,
+		.paramthresh = 4,
+		.cursorthresh = 12,
+		.wheels = {
+			{
+				.jogparam = 1, .jogfine = 41,
+				.params = { 16, 17, 18,  0, 20, 21, 22, 23 },
+				.midup = 65, .middown = 66, .midrel = 67,
+			},
+			{
+				.jogparam = 3, .jogfine = 43,
+				.params = { 32, 33, 34,  0, 36, 37, 38, 39 },
+				.midup = 65, .middown = 66, .midrel = 68,
+			},
+		},
+		.buttons = { DM2_NOBUTTONS, DM2_NOBUTTONS,
+			     48, 49, 50, 51, 52, 53, 54, 55,
+			     DM2_UNUSED, DM2_UNUSED, 58, 59, 60, 61, 62, 63 },
+		.wheellights = 1,
+	},
+	{ // Program 3: Cinelerra, only relative controls
+		.layered = 1,
+		.sliderparam = {4, 5, 2},
+		.shiftbutton = DM2_UNUSED,
+		.paramthresh = 6,
+		.cursorthresh = 20,
+		.wheels = {
+			{
+				.jogparam = 1, .jogfine = 41,
+				.notes =  { 16, 17, 18,  0, 20, 21, 22, 23 },
+				.params = { 16, 17, 18,  0, 20, 21, 22, 23 },
+				.relparams = 0x7f,
+				.notoggle = 0x7f,
+				.midup = 65, .middown = 67, .midrel = 69,
+			},
+			{
+				.jogparam = 3, .jogfine = 43,
+				.notes =  { 32, 33, 34,  0, 36, 37, 38, 39 },
+				.params = { 32, 33, 34,  0, 36, 37, 38, 39 },
+				.relparams = 0x7f,
+				.notoggle = 0x7f,
+				.midup = 66, .middown = 68, .midrel = 70,
+			},
+		},
+		.buttons = { DM2_NOBUTTONS, DM2_NOBUTTONS,
+			     48, 49, 50, 51, 52, 53, 54, 55,
+			     DM2_UNUSED, DM2_UNUSED, 58, 59, 60, 61, 62, 63 },
+		.wheellights = 1,
+	},
+};
+
+
+/* SysEx messages to the driver: F0 7D <cmd> <args...> F7 */
+#define DM2_SYSEX_ID		0x7d	/* manufacturer ID for non-commercial use */
+#define DM2_SYSEX_MAX		16	/* longest SysEx we accept, without F0/F7 */
+#define DM2_SYSEX_PICKUP	0x01	/* <param> <value>: pick up slider at value */
+#define DM2_SYSEX_FILTER	0x02	/* <slider> <mode> <amount>: noise filter */
+#define DM2_SYSEX_BUTTON	0x03	/* <bit> <mode> <velocity> <debounce>: button behaviour */
+#define DM2_SYSEX_WHEEL		0x04	/* <wheel> <mode> <touchnote>: jog output */
+#define DM2_SYSEX_STICK		0x05	/* <deadzone> <flags>: joystick geometry */
+#define DM2_SYSEX_CURVE		0x06	/* <slider> <curve>: response curve */
+#define DM2_SYSEX_LED		0x07	/* <bit> <led>: local LED feedback */
+
 struct dm2midi {
 	struct snd_card			*card;
 	struct snd_rawmidi		*rmidi;
 	struct snd_rawmidi_substream	*input;
 	struct snd_rawmidi_substream	*output;
 
-	struct tasklet_struct		tasklet;
+	dm2_bh_t			tasklet;
 	int				input_triggered;
 
 	u8		   	chan;		/* MIDI channel */
 	u8			out_rstatus;	/* MIDI Running status reminder */
+	u8			in_rstatus;	/* same for input */
+	u8			in_arg1;	/* 1st argument for input */
+	u8			in_args;	/* arguments received so far */
+	u8			sysex[DM2_SYSEX_MAX];	/* SysEx body being received */
+	int			sysex_len;
 };
 
 
@@ -33,14 +214,96 @@ struct dm2slider {
 	u8			min, max, mid;	/* Values for auto-calibration */
 	u8			dead;		/* Dead zone width in slider units */
 	u8			param;
+	u8			shiftparam;	/* param while the shift button is held */
+	u8			curvetype;	/* DM2_CURVE_* of the table below */
+	u8			curve[128];	/* Response curve, applied after calibration */
+	u8			value;		/* Last calibrated and filtered position */
 	u8			midival;
+	u8			pickup[2];	/* Value to cross before sending on param and
+						 * shiftparam, or DM2_NOPICKUP */
+	u8			filter;		/* Noise filter mode, DM2_FILTER_* */
+	u8			amount;		/* Hysteresis width or slow filter shift */
+	u16			acc;		/* Filtered position, 8.8 fixed point */
+	u32			suppressed;	/* Messages held back by the filter */
+};
+
+#define DM2_NOPICKUP 0xff
+#define DM2_SLIDER_DEAD 5		/* Dead zone around the center, raw counts */
+
+/* Sliders 0 and 1 are the X and Y axes of the joystick. */
+#define DM2_STICK_RADIUS 91		/* sqrt(64^2 + 64^2), rounded up */
+#define DM2_STICK_INVERTX 0x01
+#define DM2_STICK_INVERTY 0x02
+#define DM2_STICK_SWAP 0x04		/* X moves slider 1's output and Y slider 0's */
+
+struct dm2stick {
+	u8			deadzone;	/* Radius of the round dead zone, 0 for none */
+	u8			flags;		/* DM2_STICK_* */
+	u16			scale[2][DM2_STICK_RADIUS]; /* Output per input radius, 8.8,
+							     * below and above the center */
 };
 
+#define DM2_FILTER_NONE 0
+#define DM2_FILTER_HYST 1		/* Ignore moves within +-amount */
+#define DM2_FILTER_ADAPTIVE 2		/* One-pole lowpass, 1/2^amount at rest */
+#define DM2_FILTER_MOTION 4		/* Steps beyond this count as motion */
+
 struct dm2wheel {
-	u8			number;
+	u8			pressed;	/* Map of pressed keys */
+	u8			light;		/* Which are locked now */
+	u8			whenreleased;	/* Which state to assume when released */
+	u8			notes[8];	/* Note to be used for each button. 0 disables. */
+	u8			params[8];	/* Param for controller. 0 disables. */
+	u8			midivals[8];
+	u8			relparams;	/* Params which send relative values. */
+	u8			notoggle;      	/* Buttons which do not toggle. */
+	u8			exclusive;	/* Only one param active at a time */
+
+	u8			paramthresh;	/* Wheel turn threshold for adjusting parameters */
+	u8			cursorthresh;	/* Wheel turn threshold for adjusting the cursor */
+
+	u8			jogparam;
+	u8			jogfine;	/* LSB controller in 14 bit velocity mode, 0 for none */
+	u8			jogmidival;
+	u8			midpressed;
+
+	u8			midup;		/* If set: "up" key while mid is pressed */
+	u8			middown;	/* If set: "down" key while mid id pressed */
+	u8			midrel;		/* If set: key pressed when mid is released */
+	u8			wheelused;	/* Set if wheel has turned while holding a key */
+
 	s8			direction;
+	int			turnacc;	/* Turn accumulator before increment is done. */
+
+	u8			mode;		/* DM2_WHEEL_*, kept across programs */
+	u8			touchnote;	/* Note for touch start/stop, or DM2_UNUSED */
+	u8			touched;	/* Velocity mode: platter is moving */
+	int			velocity;	/* Smoothed speed, counts per ms * 256 */
+	ktime_t			last;		/* Time of the last velocity update */
+	ktime_t			moved;		/* Time of the last movement */
+};
+
+#define DM2_WHEEL_RELATIVE 0		/* Jog CC carries the turn since the last report */
+#define DM2_WHEEL_VELOCITY 1		/* Jog CC carries the platter speed, 64 = still */
+#define DM2_WHEEL_VELOCITY14 2		/* Same as 14 bit CC pair, jogfine is the LSB */
+#define DM2_WHEEL_TICK 10		/* ms between velocity updates without reports */
+#define DM2_WHEEL_STOP 50		/* ms without movement that end a touch */
+
+
+struct dm2button {
+	u8			note;		/* Note to send, or DM2_UNUSED */
+	u8			mode;		/* DM2_BUTTON_* */
+	u8			velocity;	/* Note on velocity in velocity mode */
+	u8			debounce;	/* Changes within this many ms are bounces */
+	u8			toggled;	/* State in toggle mode */
+	ktime_t			changed;	/* Report time of the last accepted change */
 };
 
+#define DM2_BUTTON_MOMENTARY 0		/* Press: note on, release: note off */
+#define DM2_BUTTON_TOGGLE 1		/* Every press flips the note */
+#define DM2_BUTTON_VELOCITY 2		/* Like momentary, with its own velocity */
+#define DM2_ALLBUTTONS 0x7f		/* SysEx: configure all buttons */
+
 
 #define DM2_MIDINDEX 3
 #define DM2_MIDMASK 0x02
@@ -51,12 +314,37 @@ struct dm2wheel {
 struct dm2 {
 	u8			prev_state[10];
 	u8			curr_state[10];
+	ktime_t			curr_time;	/* When curr_state arrived */
+	u32			curr_seq;	/* Counts the reports */
+	u32			seq;		/* Last report seen by the tasklet */
 	struct dm2midi dm2midi;
 	struct dm2slider	sliders[3];
+	struct dm2stick		stick;
 	struct dm2wheel 	wheels[2];
+	struct dm2button	buttons[32];	/* One for each report bit */
+	u32			buttonmask;	/* Report bits handled as plain buttons */
+	u32			buttonstate;	/* Debounced state of the report bits */
+	u8			shiftbutton;	/* Report bit of the shift key, or DM2_UNUSED */
+	u8			shifted;	/* Shift key is held */
+	u8			layered;	/* Wheel keys use the layer engine */
+	u8			wheellights;	/* Locked wheel keys light up */
+	u8			program;	/* Current program number */
+	int			next_program;	/* Program change for the tasklet, or -1 */
+	int			next_stick;	/* Joystick deadzone << 8 | flags for it, or -1 */
+	u8			next_curve[3];	/* Curves for it, or DM2_CURVE_NONE */
+	u8			next_filter[3][2];	/* Filter and amount for it, or DM2_UNUSED */
+	u32			next_buttons;	/* Report bits with a configuration for it */
+	u8			next_button[32][3];	/* Mode, velocity and debounce for them */
+	u8			next_wheels;	/* Wheels with a new mode for it */
+	u8			next_wheel[2][2];	/* Mode and touch note for them */
 	int			initialize;	/* Signals that the pots have to be initalized */
 	u8 leds[2];
 	u8 prev_leds[2];
+	u8			ledmap[32];	/* LED shown by each report bit, or DM2_UNUSED */
+	u16			ledpending;	/* LEDs set locally and not echoed yet */
+	u32			ledlocal;	/* LED changes made locally */
+	u32			ledechoes;	/* Host echoes that only confirmed them */
+	u32			ledwrites;	/* LED reports sent to the device */
 };
 
 
@@ -79,6 +367,18 @@ MODULE_DEVICE_TABLE(usb, dm2_table);
    is an integer 512 is the largest possible packet on EHCI */
 #define WRITES_IN_FLIGHT	8
 
+/* Low-speed interrupt endpoints are specified for 10-255 ms. Most hosts
+ * poll faster on request, but we don't go below this. */
+#define DM2_LOWSPEED_MIN_INTERVAL	2
+
+/* Report rate measurement, averaged over about 16 reports */
+struct dm2stats {
+	u32			reports;	/* Reports received */
+	ktime_t			last;		/* Arrival of the previous report */
+	u32			period;		/* Mean time between reports, us * 16 */
+	u32			jitter;		/* Mean deviation from it, us * 16 */
+};
+
 
 /* Structure to hold all of our device specific stuff */
 struct usb_dm2 {
@@ -92,7 +392,10 @@ struct usb_dm2 {
 	int			output_failed;		/* flag which indicates an unpatched kernel */
 	struct kref		kref;
 	struct urb		*int_in_urb;
-	int			int_in_interval;
+	int			int_in_interval;	/* bInterval of the int in endpoint */
+	int			poll_interval;		/* Override for it, 0 if none */
+	struct dm2stats		stats;
+	struct timer_list	wheel_timer;		/* runs the tasklet while a platter moves */
 
 	struct urb		*int_out_urb;		/* output URB */
 	unsigned char           *int_out_buffer;	/* the buffer to send data */
@@ -100,6 +403,14 @@ struct usb_dm2 {
 	struct dm2		dm2;
 	struct dm2midi          dm2midi;
 	spinlock_t		lock;			/* To protect tasklet from irq handler */
+
+	struct mutex		pm_lock;		/* serializes autopm references with (dis)connect */
+	int			opened;			/* open substreams, each holding an autopm reference */
+	int			suspended;		/* no I/O until resumed */
+
+	int			reclaimable;		/* card may outlive the USB device */
+	struct list_head	orphan;			/* entry in dm2_orphans while unplugged */
+	struct delayed_work	reap;			/* releases an orphan after the grace period */
 };
 #define to_dm2_dev(d) container_of(d, struct usb_dm2, kref)
 
@@ -108,3 +419,4 @@ static void dm2_midi_send(struct usb_dm2 *, u8, u8, u8);
 static void dm2_set_leds(struct usb_dm2 *, u8, u8);
 
 static void dm2_delete(struct kref *);
+static int dm2_restart_reader(struct usb_dm2 *);
@@ -0,0 +1,74 @@
+/*
+ * dm2compat.h  -  Kernel API compatibility for the Mixman DM2 driver
+ *
+ *
+ * Copyright (C) 2026 The Mixman DM2 driver authors
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation, version 2.
+ *
+ */
+
+/* Everything that depends on the kernel version lives here, so dm2.c
+ * can use one set of names. The driver itself is written against the
+ * newest API; older kernels get that API mapped onto what they have. */
+
+#ifndef DM2COMPAT_H
+#define DM2COMPAT_H
+
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+#error This driver needs Linux 4.15 or later
+#endif
+
+/* Bottom half: BH workqueues replace tasklets where they can be
+ * cancelled from process context. Before that, tasklets, whose
+ * callback gets the tasklet itself since 5.9 and an unsigned long
+ * cookie before, for which we pass the tasklet too. dm2_bh_container()
+ * turns the callback argument into the device in all three cases. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#include <linux/workqueue.h>
+typedef struct work_struct dm2_bh_t;
+#define DM2_BH_ARG struct work_struct *
+#define dm2_bh_init(bh, fn) INIT_WORK(bh, fn)
+#define dm2_bh_schedule(bh) queue_work(system_bh_wq, bh)
+#define dm2_bh_kill(bh) cancel_work_sync(bh)
+#else
+#include <linux/interrupt.h>
+typedef struct tasklet_struct dm2_bh_t;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+#define DM2_BH_ARG struct tasklet_struct *
+#define dm2_bh_init(bh, fn) tasklet_setup(bh, fn)
+#else
+#define DM2_BH_ARG unsigned long
+#define dm2_bh_init(bh, fn) tasklet_init(bh, fn, (unsigned long)(bh))
+#endif
+#define dm2_bh_schedule(bh) tasklet_schedule(bh)
+#define dm2_bh_kill(bh) tasklet_kill(bh)
+#endif
+#define dm2_bh_container(arg, type, member) container_of((dm2_bh_t *)(arg), type, member)
+
+/* Timers: timer_setup() is 4.15, the del_timer and from_timer names
+ * were replaced in 6.2 and 6.16. */
+#include <linux/timer.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+#define timer_delete_sync(t) del_timer_sync(t)
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 16, 0)
+#define timer_container_of(var, t, field) from_timer(var, t, field)
+#endif
+
+/* get_unaligned_le32() moved out of asm/ in 6.12. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+
+/* ALSA: snd_card_new() takes the parent device since 3.16, so every
+ * kernel above needs nothing here; the old snd_card_create() shim is
+ * gone with the kernels that needed it. */
+
+#endif /* DM2COMPAT_H */